@@ -19,11 +19,12 @@ AP registers we need to access
                                               --------
    00   CSW    r                              10p00111  10000111  0x87
                w                              10p00011  10100011  0xA3
-   01   TAR    w                              10p01011  10001011  0x8B
+   01   TAR    r                              10p01111  10101111  0xAF
+               w                              10p01011  10001011  0x8B
    11   DRW    r                              10p11111  10011111  0x9F
                w                              10p11011  10111011  0xBB
 
-Total of 11 codes
+Total of 12 codes
 
 -----------------------------------
 
@@ -69,12 +70,23 @@ Protocol error -- target does not respond/drive line
 #define SW_RESEND_RD            0x95
 #define SW_SELECT_WR            0xB1
 #define SW_RDBUFF_RD            0xBD
+#define SW_TARGETSEL_WR         0x99
+
+// Select(CTRLSEL)
+
+#define SW_DLCR_WR              0xA9
+
+// DLCR (WCR) fields
+
+#define DLCR_TURNROUND(n)       (((n) - 1) << 8)
+#define DLCR_WIREMODE_SYNC      (1 << 6)
 
 // ARM CoreSight SWD-AP packet request values
 // Select(0)
 
 #define SW_CSW_RD               0x87
 #define SW_CSW_WR               0xA3
+#define SW_TAR_RD               0xAF
 #define SW_TAR_WR               0x8B
 #define SW_DRW_RD               0x9F
 #define SW_DRW_WR               0xBB
@@ -103,19 +115,82 @@ Protocol error -- target does not respond/drive line
 #define REGWnR        (1 << 16)
 #define MAX_SWD_RETRY 25
 
+// Transfer list entry, see SWD_Transfer()
+
+typedef struct {
+  uint32_t req;       // SW_* request
+  uint32_t data;      // write data, read result, or value to match
+  uint32_t mask;      // reads: non-zero to poll until value matches
+} swd_xfer_t;
+
+#define SW_XFER_MISMATCH        0x10
+
+// Transfer statistics, see SWD_GetStats()
+
+typedef struct {
+  uint32_t waits;     // WAIT acknowledges
+  uint32_t sleeps;    // WAIT backoff sleeps
+  uint32_t retries;   // RESEND reads and resumed block transfers
+  uint32_t recover;   // deepest SWD_Recover() level
+} swd_stats_t;
+
+// SWD_Recover() levels, cheapest first
+
+#define SWD_RECOVER_NONE        0
+#define SWD_RECOVER_CLEAR       1   // sticky flags cleared
+#define SWD_RECOVER_RESET       2   // line reset, same IDCODE
+#define SWD_RECOVER_OPEN        3   // full reconnect
+#define SWD_RECOVER_FAIL        4
+
+// Raw DP/AP access, addr carries the bank in bits 7:4
+
+#define SWD_DP_PORT 0xFFFF
+
+typedef struct {
+  uint16_t port;        // AP number or SWD_DP_PORT
+  uint8_t  addr;
+  uint8_t  rnw;
+  uint32_t data;
+} swd_dap_t;
+
 // Interface
 
 extern uint32_t CoreID;
 int32_t  SWD_Open(void);
 int32_t  SWD_Close(void);
+void     SWD_Release(void);
+uint32_t SWD_Recover(void);
 
 uint32_t SWD_writeMem32(uint32_t address, uint32_t *data, uint32_t size);
 uint32_t SWD_readMem32(uint32_t address, uint32_t *data, uint32_t size);
 uint32_t SWD_writeMem8(uint32_t address, uint8_t *data, uint32_t size);
 uint32_t SWD_readMem8(uint32_t address, uint8_t *data, uint32_t size);
+uint32_t SWD_writeMem16(uint32_t address, uint8_t *data, uint32_t size);
+uint32_t SWD_readMem(uint32_t address, uint8_t *data, uint32_t size);
+uint32_t SWD_writeMem(uint32_t address, uint8_t *data, uint32_t size);
+uint32_t SWD_readMem16(uint32_t address, uint8_t *data, uint32_t size);
 uint32_t SWD_writeWord(uint32_t address, uint32_t data);
 uint32_t SWD_readWord(uint32_t address, uint32_t *data);
 uint32_t SWD_readReg(uint32_t idx, uint32_t *value);
 uint32_t SWD_writeReg(uint32_t idx, uint32_t value);
 uint32_t SWD_LineReset(uint32_t *idcode);
+uint32_t SWD_SetFreq(uint32_t khz);
+uint32_t SWD_GetFreq(void);
+uint32_t SWD_GetFreqTable(uint32_t *khz, uint32_t max);
+uint32_t SWD_SetSampleDelay(uint32_t cycles);
+uint32_t SWD_SetWireTiming(uint32_t turn, uint32_t idle);
+uint32_t SWD_Transfer(swd_xfer_t *list, uint32_t count, uint32_t *fail);
+uint32_t SWD_SetWaitLimit(uint32_t retries);
+void     SWD_GetStats(swd_stats_t *stats);
+void     SWD_ClearStats(void);
+uint32_t SWD_SetStrictBytes(uint32_t strict);
+uint32_t SWD_SelectAP(uint32_t ap);
+uint32_t SWD_InitAP(uint32_t ap);
+uint32_t SWD_CloseAP(uint32_t ap);
+uint32_t SWD_GetAPs(uint32_t *idr, uint32_t max);
+uint32_t SWD_SelectTarget(uint32_t targetsel, uint32_t *idcode);
+uint32_t SWD_SetJTAG(uint32_t jtag);
+uint32_t SWD_DAPBatch(swd_dap_t *list, uint32_t count, uint32_t *fail);
+uint32_t SWD_ReadDAP(uint32_t port, uint32_t addr, uint32_t *data);
+uint32_t SWD_WriteDAP(uint32_t port, uint32_t addr, uint32_t data);
 #endif
@@ -91,8 +91,29 @@ enum stlink_debug_commands {
   STLINK_DEBUG_APIV2_STOP_TRACE_RX   = 0x41,
   STLINK_DEBUG_APIV2_GET_TRACE_NB    = 0x42,
   STLINK_DEBUG_APIV2_SWD_SET_FREQ    = 0x43,
+
+  STLINK_DEBUG_APIV2_READ_DAP_REG    = 0x45,
+  STLINK_DEBUG_APIV2_WRITE_DAP_REG   = 0x46,
+  STLINK_DEBUG_APIV2_READMEM_16BIT   = 0x47,
+  STLINK_DEBUG_APIV2_WRITEMEM_16BIT  = 0x48,
+
+  STLINK_DEBUG_APIV2_INIT_AP         = 0x4B,
+  STLINK_DEBUG_APIV2_CLOSE_AP_DBG    = 0x4C,
+
+  STLINK_APIV3_SET_COM_FREQ          = 0x61,
+  STLINK_APIV3_GET_COM_FREQ          = 0x62,
   // other
   STLINK_DEBUG_ENTER_SWD             = 0xa3,
+  STLINK_DEBUG_ENTER_JTAG_NO_RESET   = 0xa4,
+
+  // iulink extensions
+  STLINK_DEBUG_IULINK_SWD_SAMPLE     = 0xe0,
+  STLINK_DEBUG_IULINK_SWD_TIMING     = 0xe1,
+  STLINK_DEBUG_IULINK_SWD_WAIT       = 0xe2,
+  STLINK_DEBUG_IULINK_STRICT_BYTES   = 0xe3,
+  STLINK_DEBUG_IULINK_AP_LIST        = 0xe4,
+  STLINK_DEBUG_IULINK_SWD_TARGET     = 0xe5,
+  STLINK_DEBUG_IULINK_DAP_BATCH      = 0xe6,
 };
 
 
@@ -0,0 +1,204 @@
+/**************************************************************************
+*      Copyright 2018  Geoffrey Brown                                     *
+*                                                                         *
+*                                                                         *
+*                                                                         *
+* Licensed under the Apache License, Version 2.0 (the "License");         *
+* you may not use this file except in compliance with the License.        *
+* You may obtain a copy of the License at                                 *
+*                                                                         *
+*     http://www.apache.org/licenses/LICENSE-2.0                          *
+*                                                                         *
+* Unless required by applicable law or agreed to in writing, software     *
+* distributed under the License is distributed on an "AS IS" BASIS,       *
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*
+* See the License for the specific language governing permissions and     *
+* limitations under the License.                                          *
+**************************************************************************/
+
+/*
+ *  Build options for the SWD engine (ll_swd.c).
+ *
+ *  Every option can be overridden from the command line, the Makefile
+ *  maps its USE_SWD_* variables onto these.
+ */
+
+#ifndef SWDCONF_H
+#define SWDCONF_H
+
+#ifndef TRUE
+#define TRUE  1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+/*
+ *  Shift the request header and the 32-bit data phase through SPI1
+ *  instead of bit-banging them.  ACK and turnaround stay bit-banged.
+ *  Requires TGT_SWCLK on SPI1_SCK (PA5) and TGT_SWDIO on SPI1_MOSI
+ *  (PA7), the current baseboard does not route them there.
+ */
+
+#if !defined(SWD_USE_SPI)
+#define SWD_USE_SPI                 FALSE
+#endif
+
+/*
+ *  Run the shift loops and transaction layer from SRAM (.ramtext).
+ *  The Makefile adds swd_ramtext.ld to check the RAM budget.
+ */
+
+#if !defined(SWD_RAM_EXEC)
+#define SWD_RAM_EXEC                FALSE
+#endif
+
+/*
+ *  Clock the data phase of DRW write bursts out of a BSRR pattern
+ *  buffer with TIM1 and DMA1 channel 5.  Costs 536 bytes of RAM.
+ */
+
+#if !defined(SWD_USE_DMA)
+#define SWD_USE_DMA                 FALSE
+#endif
+
+/*
+ *  Shortest half clock period, in timer clocks, the DMA can sustain
+ *  while the USB and the CPU share the bus.
+ */
+
+#if !defined(SWD_DMA_MIN_HALF)
+#define SWD_DMA_MIN_HALF            8
+#endif
+
+/*
+ *  Tune the SWD clock: SWD_Open steps down from the host's rate until
+ *  the link reads cleanly, errors at run time step it down further.
+ */
+
+#if !defined(SWD_AUTO_CLOCK)
+#define SWD_AUTO_CLOCK              TRUE
+#endif
+
+// IDCODE + pattern read-back rounds a setting must pass on connect
+
+#if !defined(SWD_CLOCK_PASSES)
+#define SWD_CLOCK_PASSES            4
+#endif
+
+// parity/no-ACK errors within SWD_CLOCK_WINDOW good transactions
+// that make the clock step down
+
+#if !defined(SWD_CLOCK_ERRORS)
+#define SWD_CLOCK_ERRORS            3
+#endif
+
+#if !defined(SWD_CLOCK_WINDOW)
+#define SWD_CLOCK_WINDOW            256
+#endif
+
+/*
+ *  Run each SWD transaction with interrupts masked, as long as one
+ *  transaction takes no longer than SWD_RT_MAX_US at the selected
+ *  clock.  Bounds the interrupt latency seen by USB.
+ */
+
+#if !defined(SWD_REALTIME)
+#define SWD_REALTIME                FALSE
+#endif
+
+#if !defined(SWD_RT_MAX_US)
+#define SWD_RT_MAX_US               50
+#endif
+
+/*
+ *  Turnaround clocks (1-4, programmed into the DP's DLCR on connect)
+ *  and idle clocks after each data phase.  Both can be changed by the
+ *  host with STLINK_DEBUG_IULINK_SWD_TIMING.
+ */
+
+#if !defined(SWD_TURNAROUND)
+#define SWD_TURNAROUND              1
+#endif
+
+#if !defined(SWD_IDLE_CYCLES)
+#define SWD_IDLE_CYCLES             0
+#endif
+
+/*
+ *  Multi-word DRW writes run with ORUNDETECT set and are streamed
+ *  without waiting on each ACK, errors are picked up once per page
+ *  from the sticky flags.  Not used with SWD_USE_DMA.
+ */
+
+#if !defined(SWD_ORUN_WRITE)
+#define SWD_ORUN_WRITE              TRUE
+#endif
+
+#if SWD_USE_DMA
+#undef  SWD_ORUN_WRITE
+#define SWD_ORUN_WRITE              FALSE
+#endif
+
+/*
+ *  WAITs retried back to back before SWD_Access starts sleeping
+ *  between attempts, the longest sleep, and the most time the host's
+ *  WAIT limit may spend sleeping in one access.
+ */
+
+#if !defined(SWD_WAIT_SPIN)
+#define SWD_WAIT_SPIN               4
+#endif
+
+#if !defined(SWD_WAIT_MAX_US)
+#define SWD_WAIT_MAX_US             1600
+#endif
+
+#if !defined(SWD_WAIT_MAX_MS)
+#define SWD_WAIT_MAX_MS             2000
+#endif
+
+/*
+ *  Access ports enumerated on connect and addressable by the memory
+ *  commands.
+ */
+
+#if !defined(SWD_MAX_APS)
+#define SWD_MAX_APS                 4
+#endif
+
+// multidrop targets whose DP state is kept
+
+#if !defined(SWD_MAX_TARGETS)
+#define SWD_MAX_TARGETS             4
+#endif
+
+/*
+ *  JTAG-DP transport for targets without SWD.  TCK and TMS are
+ *  TGT_SWCLK and TGT_SWDIO, TDI and TDO need two more pins on the
+ *  same port, LINE_TGT_TDI and LINE_TGT_TDO in board.h.  The current
+ *  baseboard does not have them.
+ */
+
+#if !defined(SWD_USE_JTAG)
+#define SWD_USE_JTAG                FALSE
+#endif
+
+/*
+ *  SWD_Close (debug exit) releases the core but leaves the DP powered
+ *  and the pins driven, an SWD_Open within SWD_PARK_MS checks IDCODE
+ *  and CTRL/STAT and carries on without reconnecting.  After SWD_PARK_MS
+ *  without a host command the link is powered down as on a normal
+ *  exit, so battery powered targets do not stay powered up.  FALSE
+ *  powers the DP down and releases the pins on every exit.
+ */
+
+#if !defined(SWD_KEEP_LINK)
+#define SWD_KEEP_LINK               TRUE
+#endif
+
+#if !defined(SWD_PARK_MS)
+#define SWD_PARK_MS                 1000
+#endif
+
+#endif /* SWDCONF_H */
@@ -15,6 +15,9 @@
 
 extern const USBConfig usbcfg;
 msg_t BULK_Receive(uint8_t *Buf, uint16_t len);
+void  BULK_StartReceive(uint8_t *Buf, uint16_t len);
+msg_t BULK_WaitReceive(void);
+msg_t BULK_WaitReceiveTimeout(sysinterval_t timeout);
 msg_t BULK_Transmit(uint8_t *Buf, uint16_t len);
 
 #endif  /* USBCFG_H */
@@ -17,8 +17,10 @@
 **************************************************************************/
 
 #include <stdint.h>
+#include <string.h>
 #include <dp_swd.h>
 #include <debug_cm.h>
+#include "swdconf.h"
 #include "hal.h"
 #include "usbcfg.h"
 #include "app.h"
@@ -26,12 +28,137 @@
 
 #define REGRETRIES 20
 #define DELCNT 1
+#define DEFAULT_KHZ 2600
+#define DELAY_CYCLES 5          // CPU cycles per delay() count
 
 static const int AUTO_INCREMENT_PAGE_SIZE = 1024 ;
 static const int CSW_VALUE = (CSW_RESERVED | CSW_MSTRDBG | CSW_HPROT
 			      | CSW_DBGSTAT | CSW_SADDRINC);
 uint32_t CoreID = 0;
 
+/*
+ *  With SWD_RAM_EXEC the shift loops and the transaction layer are
+ *  linked into .ramtext, which crt0 copies to SRAM with .data, so they
+ *  run without flash wait states.  RAM is out of BL range from flash,
+ *  hence long_call; noinline keeps them from being pulled back into
+ *  flash-resident callers.
+ */
+
+#if SWD_RAM_EXEC
+#define SWD_RAMFUNC __attribute__((long_call, noinline, section(".ramtext")))
+#else
+#define SWD_RAMFUNC
+#endif
+
+/*
+ *  SWD clock settings, fastest first.  Each entry is a half-period
+ *  delay count for the shift loops; the rates are computed from the
+ *  loop cycle counts at 48 MHz (about 8 cycles per bit plus 10 per
+ *  delay count) and should be rechecked on a scope whenever the shift
+ *  loops change.  Delay 0 selects the variant without delay loops.
+ */
+
+static const struct {
+  uint16_t khz;
+  uint16_t delay;
+} swd_clocks[] = {
+  { 6000,    0 },
+  { 2600,    1 },
+  { 1700,    2 },
+  { 1000,    4 },
+  {  480,    9 },
+  {  240,   19 },
+  {  120,   38 },
+  {   60,   79 },
+  {   30,  159 },
+  {    5,  959 },
+};
+
+#define SWD_CLOCKS (sizeof(swd_clocks)/sizeof(swd_clocks[0]))
+
+#if SWD_USE_SPI
+// SPI1 SCK (PCLK / 2^(BR+1)) for prescaler br, and the fastest
+// prescaler not above khz; 7 when even that is too fast, the data
+// phases are then bit-banged
+
+#define SPI_KHZ(br)   (((uint32_t) STM32_PCLK / 2000) >> (br))
+#define SPI_BR_FOR(k) ((SPI_KHZ(0) <= (k)) ? 0 : (SPI_KHZ(1) <= (k)) ? 1 : \
+		       (SPI_KHZ(2) <= (k)) ? 2 : (SPI_KHZ(3) <= (k)) ? 3 : \
+		       (SPI_KHZ(4) <= (k)) ? 4 : (SPI_KHZ(5) <= (k)) ? 5 : \
+		       (SPI_KHZ(6) <= (k)) ? 6 : 7)
+#define SPI_REACHES(k) (SPI_KHZ(SPI_BR_FOR(k)) <= (k))
+#endif
+
+// the rate the data phases of table entry i actually run at
+
+static uint32_t clockKHz(uint32_t i) {
+  uint32_t khz = swd_clocks[i].khz;
+#if SWD_USE_SPI
+  if (SPI_REACHES(khz))
+    khz = SPI_KHZ(SPI_BR_FOR(khz));
+#endif
+  return khz;
+}
+
+static uint32_t swd_delay = DELCNT;
+static uint32_t swd_khz   = DEFAULT_KHZ;
+static uint32_t swd_clock = 1;          // table index in use
+static uint32_t swd_ceiling = 1;        // fastest index the host allows
+static uint32_t swd_sample = 0;         // read sample delay, see SWD_IN_BIT
+static uint32_t swd_turn = 1;           // turnaround clocks, matches DLCR
+static uint32_t swd_turn_cfg = SWD_TURNAROUND;  // wanted turnaround
+static uint32_t swd_idle = SWD_IDLE_CYCLES; // idle clocks after a data phase
+static uint32_t swd_wait_limit = MAX_SWD_RETRY; // WAIT retries, host settable
+static swd_stats_t swd_stats;           // since the last SWD_ClearStats
+static uint32_t swd_parked = 0;         // IDCODE of the link SWD_Close left up
+static bool swd_timedout = false;       // last failure ran out of WAITs
+static bool swd_dataphase = false;      // ORUNDETECT set in CTRL/STAT
+#if SWD_USE_JTAG
+#if !defined(LINE_TGT_TDI) || !defined(LINE_TGT_TDO)
+#error "SWD_USE_JTAG needs LINE_TGT_TDI and LINE_TGT_TDO in board.h"
+#endif
+static bool swd_jtag = false;           // JTAG-DP transport, SWD_SetJTAG
+#else
+#define swd_jtag false
+#endif
+
+/*
+ *  Real-time mode
+ *
+ *     Each transaction runs with interrupts masked so that the USB
+ *     ISR and the charger thread cannot stretch a clock phase.  Only
+ *     done when a whole transaction fits in SWD_RT_MAX_US at the
+ *     selected rate, turnaround, idle cycles and read sample delay;
+ *     rtCheck() redoes the sums whenever one of them changes.  Never
+ *     done over JTAG, where a transaction is several scans.  Pending
+ *     interrupts are taken between transactions.  The lock nests,
+ *     SPI_ShiftIn32 uses it too.
+ */
+
+#define SWD_TRANSACTION_BITS 54  // with one clock turnaround, no idle
+#define SWD_INPUT_BITS       36  // ACK, data and parity, without turns
+
+#if SWD_REALTIME
+static bool swd_rt = false;
+
+static void rtCheck(void) {
+  uint32_t bits = SWD_TRANSACTION_BITS + 2*(swd_turn - 1) + swd_idle;
+  uint64_t ns;
+  ns  = (uint64_t) bits * 1000000 / clockKHz(swd_clock);  // the slower one
+  ns += (uint64_t) (SWD_INPUT_BITS + 2*swd_turn) * swd_sample *
+    DELAY_CYCLES * 1000 / 48;           // delay counts at 48 MHz
+  swd_rt = !swd_jtag && (ns <= SWD_RT_MAX_US * 1000);
+}
+#define SWD_RT_BEGIN(sts) do { (sts) = 0;				\
+    if (swd_rt) (sts) = chSysGetStatusAndLockX(); } while (0)
+#define SWD_RT_END(sts)   do {						\
+    if (swd_rt) chSysRestoreStatusX(sts); } while (0)
+#else
+#define rtCheck()         do { } while (0)
+#define SWD_RT_BEGIN(sts) do { (void) (sts); } while (0)
+#define SWD_RT_END(sts)   do { (void) (sts); } while (0)
+#endif
+
 static inline void delay(int i){
   for (; i > 0; i--) {
     asm("mov r0,r0");
@@ -57,6 +184,8 @@ static inline void toOutput(ioline_t line) {
 }
 
 static void _SetSWPinsIdle(void){
+  osalDbgAssert(PAL_PORT(LINE_TGT_SWDIO) == PAL_PORT(LINE_TGT_SWCLK),
+		"SWDIO and SWCLK on different ports");
   palClearLine(LINE_TGT_SWCLK);
   palSetLine(LINE_TGT_SWDIO);
 
@@ -66,6 +195,9 @@ static void _SetSWPinsIdle(void){
 
 static void _ResetDebugPins(void){
   toInput(LINE_TGT_SWDIO);
+#if SWD_USE_JTAG
+  toInput(LINE_TGT_TDI);
+#endif
 }
 
 static inline void _SetSWDIOasOutput(void){
@@ -75,55 +207,136 @@ static inline void _SetSWDIOasInput(void){
   toInput(LINE_TGT_SWDIO);
 }
 
-static inline uint32_t SWDIO_IN(void){
-  uint8_t b;
+/*
+ *  Pin level PHY
+ *
+ *     Port and pin positions are compile-time constants taken from
+ *     board.h, so every access below is a single store to BSRR or a
+ *     single load of IDR.  SWDIO and SWCLK must share a GPIO port.
+ *     Output drives data and the falling clock edge with one BSRR
+ *     store: BR(SWDIO) shifted down by 16 is BS(SWDIO), so the data
+ *     bit selects the half without a branch.
+ */
 
-  b = palReadLine(LINE_TGT_SWDIO);
-  palSetLine(LINE_TGT_SWCLK);
-  delay(DELCNT);
-  palClearLine(LINE_TGT_SWCLK);
+#define SWD_PORT    PAL_PORT(LINE_TGT_SWDIO)
+#define SWDIO_PIN   PAL_PAD(LINE_TGT_SWDIO)
+#define SWCLK_PIN   PAL_PAD(LINE_TGT_SWCLK)
+#define SWDIO_BR    (1U << (SWDIO_PIN + 16))
+#define SWCLK_BS    (1U << SWCLK_PIN)
+#define SWCLK_BR    (1U << (SWCLK_PIN + 16))
 
-  return b;
-}
+// data bit to the pin with the clock low, then raise the clock
+
+#define SWD_OUT_BIT(data, d) do {					\
+    SWD_PORT->BSRR = (SWDIO_BR >> (((data) & 1) << 4)) | SWCLK_BR;	\
+    delay(d);								\
+    SWD_PORT->BSRR = SWCLK_BS;						\
+    (data) >>= 1;							\
+    delay(d);								\
+  } while (0)
+
+/*
+ *  Sample SWDIO into bit 31, then pulse the clock.  With s == 0 the
+ *  sample is taken at the end of the low phase, just before the rising
+ *  edge.  With s > 0 it is taken s delay counts after the rising edge
+ *  instead, for paths (isolators, long cables) whose round trip delay
+ *  is close to a clock period; the high phase grows by s.
+ */
+
+#define SWD_SAMPLE(in)							\
+  ((in) = ((in) >> 1) | ((SWD_PORT->IDR << (31 - SWDIO_PIN)) & 0x80000000U))
+
+#define SWD_IN_BIT(in, d, s) do {					\
+    delay(d);								\
+    if (!(s))								\
+      SWD_SAMPLE(in);							\
+    SWD_PORT->BSRR = SWCLK_BS;						\
+    if (s) {								\
+      delay(s);								\
+      SWD_SAMPLE(in);							\
+    }									\
+    delay(d);								\
+    SWD_PORT->BSRR = SWCLK_BR;						\
+  } while (0)
+
+/*
+ *  The shift routines are written once with the delay counts as
+ *  parameters and always inlined, so the d == 0 and s == 0 call sites
+ *  below compile to loops with the delays folded away.  Whole bytes
+ *  are unrolled eight bits at a time.
+ */
 
-static inline uint32_t SW_ShiftIn(uint8_t bits){
+static inline __attribute__((always_inline))
+uint32_t _SW_ShiftIn(uint8_t bits, int d, int s){
   int i;
   uint32_t in = 0;
-  for (i = 0; i < bits; i++) {
-    in = (in >> 1) | ((SWDIO_IN()&1) << (bits - 1));
+  for (i = bits; i >= 8; i -= 8) {
+    SWD_IN_BIT(in, d, s); SWD_IN_BIT(in, d, s);
+    SWD_IN_BIT(in, d, s); SWD_IN_BIT(in, d, s);
+    SWD_IN_BIT(in, d, s); SWD_IN_BIT(in, d, s);
+    SWD_IN_BIT(in, d, s); SWD_IN_BIT(in, d, s);
   }
-  return in;
+  for (; i > 0; i--)
+    SWD_IN_BIT(in, d, s);
+  return in >> (32 - bits);
+}
+
+SWD_RAMFUNC static uint32_t SW_ShiftIn(uint8_t bits){
+  if (swd_sample)
+    return _SW_ShiftIn(bits, swd_delay, swd_sample);
+  else if (swd_delay)
+    return _SW_ShiftIn(bits, swd_delay, 0);
+  else
+    return _SW_ShiftIn(bits, 0, 0);
 }
 
 static inline uint32_t SW_ShiftInBytes(uint8_t bytes) {
- int i;
- uint32_t tmp;
  if (bytes > 4) return 0;
+ return SW_ShiftIn(bytes*8);
+}
 
- for (i = 0; i < bytes; i++) {
-   ((uint8_t *) &tmp)[i] = SW_ShiftIn(8);
- }
- return tmp;
+static inline __attribute__((always_inline))
+void _SW_ShiftOut(uint32_t data, int bits, int d)
+{
+  int i;
+
+  for (i = bits; i >= 8; i -= 8) {
+    SWD_OUT_BIT(data, d); SWD_OUT_BIT(data, d);
+    SWD_OUT_BIT(data, d); SWD_OUT_BIT(data, d);
+    SWD_OUT_BIT(data, d); SWD_OUT_BIT(data, d);
+    SWD_OUT_BIT(data, d); SWD_OUT_BIT(data, d);
+  }
+  for (; i > 0; i--)
+    SWD_OUT_BIT(data, d);
+  SWD_PORT->BSRR = SWCLK_BR;
+}
+
+SWD_RAMFUNC static void SW_ShiftOut(uint32_t data, uint8_t bits)
+{
+  if (swd_delay)
+    _SW_ShiftOut(data, bits, swd_delay);
+  else
+    _SW_ShiftOut(data, bits, 0);
 }
 
 static inline void SW_ShiftOutBytes(uint32_t data, uint8_t bytes)
 {
-  int i;
   if (bytes > 4) return;
+  SW_ShiftOut(data, bytes*8);
+}
 
-  for (i = 0; i < bytes*8; i++) {
-    if (data & 1)
-      palSetLine(LINE_TGT_SWDIO);
-    else
-      palClearLine(LINE_TGT_SWDIO);
-    palSetLine(LINE_TGT_SWCLK);
-    delay(DELCNT);
-    data = data >> 1;
-    palClearLine(LINE_TGT_SWCLK);
-  }
+// idle cycles (SWDIO driven low) after a data phase
+
+static inline void SW_Idle(void)
+{
+  uint32_t n;
+  for (n = swd_idle; n > 32; n -= 32)
+    SW_ShiftOut(0, 32);
+  if (n)
+    SW_ShiftOut(0, n);
 }
 
-static inline uint32_t Parity(uint32_t x) {
+static inline __attribute__((always_inline)) uint32_t Parity(uint32_t x) {
   uint32_t y;
   y = x ^ (x >> 1);
   y = y ^ (y >> 2);
@@ -133,7 +346,28 @@ static inline uint32_t Parity(uint32_t x) {
   return y & 1;
 }
 
-static uint32_t SWD_TransactionBB(uint32_t req, uint32_t *data) {
+/*
+ *  WAIT/FAULT: turnaround only, unless ORUNDETECT is set.  The DP
+ *  then still expects the data phase, 33 clocks nobody drives for a
+ *  read and 33 zeros for a write.
+ */
+
+static inline __attribute__((always_inline)) void SW_NoData(uint32_t req) {
+  if (swd_dataphase && (req & SW_REQ_RnW)) {
+    SW_ShiftInBytes(4);                  // data
+    SW_ShiftIn(swd_turn + 1);            // parity + turn
+    _SetSWDIOasOutput();
+    return;
+  }
+  SW_ShiftIn(swd_turn);                  // turnaround
+  _SetSWDIOasOutput();
+  if (swd_dataphase) {
+    SW_ShiftOutBytes(0,4);               // data
+    SW_ShiftOut(0,1);                    // parity
+  }
+}
+
+SWD_RAMFUNC static uint32_t SWD_TransactionBB(uint32_t req, uint32_t *data) {
 
   uint32_t ack;
   uint32_t pbit;
@@ -142,301 +376,2164 @@ static uint32_t SWD_TransactionBB(uint32_t req, uint32_t *data) {
   SW_ShiftOutBytes(req,1);               // Send header
 
   _SetSWDIOasInput();                    // Set pin direction
-  ack = (SW_ShiftIn(4) >> 1) & 7;        // ACK, toss the turnaround bit
+  ack = (SW_ShiftIn(swd_turn + 3) >> swd_turn) & 7; // ACK, toss turnaround
 
   switch (ack) {
   case SW_ACK_OK :                       // good to go
     if (req & SW_REQ_RnW) {              // read
       *data = SW_ShiftInBytes(4);        // get data
-      pbit = SW_ShiftIn(2)&1;            // get parity bit, toss turnaround
+      pbit = SW_ShiftIn(swd_turn + 1)&1; // get parity bit, toss turnaround
       if (pbit ^ Parity(*data)) {        // parity check
 	ack = SW_ACK_PARITY_ERR;
 	EPRINTF("parity error data 0x%x pbit %x\r\n", *data, pbit);
       }
       _SetSWDIOasOutput();               // restore direction
     } else {                             // write
-      SW_ShiftIn(1);                     // turnaround
+      SW_ShiftIn(swd_turn);              // turnaround
       _SetSWDIOasOutput();               // restore direction
       SW_ShiftOutBytes(*data,4);         // data
-      SW_ShiftOutBytes(Parity(*data), 1);// parity 
+      SW_ShiftOut(Parity(*data), 1);     // parity 
     }
+    SW_Idle();
     break;
 
   case SW_ACK_WAIT  :
   case SW_ACK_FAULT :
-      SW_ShiftIn(1);                      // turnaround
-      _SetSWDIOasOutput();                // restore direction
+      SW_NoData(req);                     // restores direction
       break;
 
   default :                               // no ack, back off in case of data phase
     SW_ShiftInBytes(4);                   // data
-    SW_ShiftIn(2);                        // parity + turn
+    SW_ShiftIn(swd_turn + 1);             // parity + turn
     _SetSWDIOasOutput();                  // restore direction
   }
   _SetSWDIOasInput();                    // Set pin direction
   return ack;
 }
 
-static uint32_t SWD_Transaction(uint32_t req, uint32_t *data, uint32_t retry){
-  uint32_t ack   = 0;
-  // try transaction  (always at least once)
-  do {  
-    ack = SWD_TransactionBB(req, data);
-    if ((ack == SW_ACK_WAIT) && retry--)
-      continue;
-    else
-      break;
-  } while (retry);
-  return ack;   // errors handled up call chain
-}
+#if SWD_USE_SPI
 
-static void SW_ShiftReset(void){
-  SW_ShiftOutBytes(0xffffffff, 4);
-  SW_ShiftOutBytes(0xffffffff, 3);
+/*
+ *  SPI1 engine
+ *
+ *     SWCLK is SPI1_SCK and SWDIO is SPI1_MOSI used as a bidirectional
+ *     (BIDIMODE) data line.  Mode 0, LSB first matches SWD: data changes
+ *     while the clock is low, the target samples on the rising edge.
+ *     The pins are GPIO between transactions so that the bit-bang
+ *     routines (reset sequences, ACK, turnaround, parity) still work;
+ *     they are handed to SPI1 only for the byte-aligned phases.
+ */
+
+#if !defined(GPIOA_TGT_SWCLK) || (GPIOA_TGT_SWCLK != 5U) || \
+    !defined(GPIOA_TGT_SWDIO) || (GPIOA_TGT_SWDIO != 7U)
+#error "SWD_USE_SPI needs TGT_SWCLK on PA5 (SPI1_SCK), TGT_SWDIO on PA7 (SPI1_MOSI)"
+#endif
+
+static uint32_t spi_br = SPI_BR_FOR(DEFAULT_KHZ);
+static bool     spi_on = SPI_REACHES(DEFAULT_KHZ); // rate within reach of SCK
+
+#define SPI_CR1_SWD  (SPI_CR1_BIDIMODE | SPI_CR1_LSBFIRST | SPI_CR1_SSM | \
+		      SPI_CR1_SSI | SPI_CR1_MSTR | (spi_br * SPI_CR1_BR_0))
+#define SPI_CR2_DS8  ((8 - 1) << SPI_CR2_DS_Pos)
+#define SPI_CR2_DS16 ((16 - 1) << SPI_CR2_DS_Pos)
+
+static void _SPI_Init(void) {
+  rccEnableSPI1(FALSE);
+  SPI1->CR1 = 0;
+  SPI1->CR2 = SPI_CR2_DS8 | SPI_CR2_FRXTH;
+  SPI1->CR1 = SPI_CR1_SWD | SPI_CR1_BIDIOE;
 }
 
-uint32_t SWD_LineReset(uint32_t *idcode){
-  uint32_t ack;
+static void _SPI_Stop(void) {
+  SPI1->CR1 = 0;
+  rccDisableSPI1();
+}
 
-  // SWD reset sequence:  
-  //          56 1's, 8 0's, Read IDcode
-  //          SW_IDCODE_RD not allowed to wait or fault
-  _SetSWDIOasOutput();
-  SW_ShiftReset();  
-  SW_ShiftOutBytes(0,1);
-  ack = SWD_Transaction(SW_IDCODE_RD, idcode, 0);
-  return ack;
+static inline void _SPI_Attach(void) {
+  toAlternate(LINE_TGT_SWCLK);
+  toAlternate(LINE_TGT_SWDIO);
 }
 
-static uint32_t SWD_Connect(uint32_t *idcode){
-  // Init Pins 
-  _SetSWPinsIdle(); 
-  // Select SWD Port
-  _SetSWDIOasOutput();
-  SW_ShiftReset();              
-  SW_ShiftOutBytes(0xE79E,2);
-  // Finish with Line reset
-  return SWD_LineReset(idcode); 
+// SCK idles low, so the GPIO takes over the clock without a glitch
+
+static inline void _SPI_Detach(void) {
+  toOutput(LINE_TGT_SWCLK);
+  toInput(LINE_TGT_SWDIO);
 }
 
-static void SWD_Disconnect(void){
- // set pins to idle state
-  _SetSWPinsIdle(); 
- // select JTAG port
-  _SetSWDIOasOutput();
-  SW_ShiftReset();  
-  SW_ShiftOutBytes(0xE73C,2);
-  SW_ShiftReset();  
-  // Release pins (except nReset)
-  _ResetDebugPins();
+// Transmit 1-4 bytes, the TX fifo holds all of them
+
+SWD_RAMFUNC static void SPI_ShiftOutBytes(uint32_t data, uint8_t bytes) {
+  int i;
+  SPI1->CR1 = SPI_CR1_SWD | SPI_CR1_BIDIOE | SPI_CR1_SPE;
+  for (i = 0; i < bytes; i++) {
+    *(volatile uint8_t *) &SPI1->DR = data;
+    data = data >> 8;
+  }
+  while (SPI1->SR & (SPI_SR_FTLVL | SPI_SR_BSY))
+    ;
+  SPI1->CR1 = SPI_CR1_SWD | SPI_CR1_BIDIOE;
 }
 
 /*
- *   Public Debug Port access functions
- *     TRANSACTION macro used to catch errors and
- *     clear error condition
+ *  Receive 32 bits as two 16-bit frames.  In bidirectional receive
+ *  mode the master clocks as long as SPE is set, so SPE is dropped
+ *  while the second frame is in flight.  That window is 16 SCK
+ *  periods and must not be stretched by an interrupt.
  */
 
-#define TRANSACTION(reg,op) \
-  do { int ack = errorClear(SWD_Transaction(reg,op,MAX_SWD_RETRY)); \
-    if (ack) { \
-      EPRINTF("trans fail %d reg %x op %x\r\n", ack, reg, op);	\
-      return ack; \
-    }} while (0)
+SWD_RAMFUNC static uint32_t SPI_ShiftIn32(void) {
+  uint32_t lo, hi;
+  syssts_t sts;
+
+  SPI1->CR2 = SPI_CR2_DS16;
+  sts = chSysGetStatusAndLockX();
+  SPI1->CR1 = SPI_CR1_SWD | SPI_CR1_SPE;
+  while (!(SPI1->SR & SPI_SR_RXNE))
+    ;
+  SPI1->CR1 = SPI_CR1_SWD;
+  chSysRestoreStatusX(sts);
+  lo = *(volatile uint16_t *) &SPI1->DR;
+  while (!(SPI1->SR & SPI_SR_RXNE))
+    ;
+  hi = *(volatile uint16_t *) &SPI1->DR;
+  while (SPI1->SR & SPI_SR_BSY)
+    ;
+  SPI1->CR2 = SPI_CR2_DS8 | SPI_CR2_FRXTH;
+  SPI1->CR1 = SPI_CR1_SWD | SPI_CR1_BIDIOE;
+  return lo | (hi << 16);
+}
 
-static uint32_t errorClear(uint32_t ack){
-  uint32_t tmp;
-  if (ack == SW_ACK_OK)
-    return 0;
+SWD_RAMFUNC static uint32_t SWD_TransactionSPI(uint32_t req, uint32_t *data) {
 
-  // parity error requires no special clearing
+  uint32_t ack;
+  uint32_t pbit;
 
-  if (ack == SW_ACK_PARITY_ERR)
-    return 1;
+  _SPI_Attach();
+  SPI_ShiftOutBytes(req,1);              // Send header
+  _SPI_Detach();                         // SWDIO is now an input
 
-  // Read CSR if this fails, we need to do a line reset 
+  ack = (SW_ShiftIn(swd_turn + 3) >> swd_turn) & 7; // ACK, toss turnaround
 
-  if (ack == 7) {  // nothing came back !
-    EPRINTF("transaction returned 7\r\n");
-    return 1;
-  }
+  switch (ack) {
+  case SW_ACK_OK :                       // good to go
+    if (req & SW_REQ_RnW) {              // read
+      _SPI_Attach();
+      *data = SPI_ShiftIn32();           // get data
+      _SPI_Detach();
+      pbit = SW_ShiftIn(swd_turn + 1)&1; // get parity bit, toss turnaround
+      if (pbit ^ Parity(*data)) {        // parity check
+	ack = SW_ACK_PARITY_ERR;
+	EPRINTF("parity error data 0x%x pbit %x\r\n", *data, pbit);
+      }
+      _SetSWDIOasOutput();
+    } else {                             // write
+      SW_ShiftIn(swd_turn);              // turnaround
+      _SPI_Attach();
+      SPI_ShiftOutBytes(*data,4);        // data
+      _SPI_Detach();
+      _SetSWDIOasOutput();
+      SW_ShiftOut(Parity(*data), 1);     // parity 
+    }
+    SW_Idle();
+    break;
 
-  EPRINTF("Error clear %d\r\n", ack);
-  if (SW_ACK_OK != SWD_Transaction(SW_CTRLSTAT_RD, &tmp, 0))  {
-    EPRINTF("Error clear line reset\r\n");
-    SWD_LineReset(&tmp);
-  } 
- 
-  // clear error/sticky bits in abort reg
-  // if this fails, we're truly wedged
+  case SW_ACK_WAIT  :
+  case SW_ACK_FAULT :
+      SW_NoData(req);
+      break;
 
-  tmp = (STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR);
-  if (SW_ACK_OK != SWD_Transaction(SW_ABORT_WR, &tmp,0)) {
-    EPRINTF("Clear sticky bits failed !\r\n");
-    return 2;
+  default :                               // no ack, back off in case of data phase
+    SW_ShiftInBytes(4);                   // data
+    SW_ShiftIn(swd_turn + 1);             // parity + turn
   }
+  _SetSWDIOasInput();                    // Set pin direction
+  return ack;
+}
 
+// below PCLK/256 the whole transaction is bit-banged
 
-  // set CSW to 32-bit, autoinc
-  // this better not fail !
+#define SWD_TransactionPHY(req, data)					\
+  (spi_on ? SWD_TransactionSPI(req, data) : SWD_TransactionBB(req, data))
+#else
+#define SWD_TransactionPHY SWD_TransactionBB
+#endif
 
-  tmp = CSW_VALUE | CSW_SIZE32;       
-  if (SW_ACK_OK != SWD_Transaction(SW_CSW_WR, &tmp, MAX_SWD_RETRY))
-    return 2;
-  return 1;
-}
+#if SWD_USE_JTAG
 
-static uint32_t _SWD_writeMem32(uint32_t address, uint32_t *data, 
-				uint32_t size) {
-  uint32_t i;
-  uint32_t tmp;
+/*
+ *  JTAG engine
+ *
+ *     TCK is SWCLK and TMS is SWDIO, TDI and TDO are two more pins on
+ *     the same port.  Each bit is one BSRR store that drives TDI and
+ *     TMS with the falling clock edge, TDO is sampled just before the
+ *     rising edge.  Scans end in Update-IR/DR and go straight on to
+ *     the next one, visiting Run-Test/Idle only for the idle clocks.
+ */
 
-  tmp = CSW_VALUE | CSW_SIZE32;
-  TRANSACTION(SW_CSW_WR, &tmp);  
-  // Write TAR register 
-  TRANSACTION(SW_TAR_WR, &address);
-  // Write data
-  for (i = 0; i < size/4; i++) 
-    TRANSACTION(SW_DRW_WR,data++);
-  // dummy read to flush transaction
-  TRANSACTION(SW_RDBUFF_RD,&tmp);
-  return 0;
+#define TDI_PIN     PAL_PAD(LINE_TGT_TDI)
+#define TDO_PIN     PAL_PAD(LINE_TGT_TDO)
+#define TDI_BR      (1U << (TDI_PIN + 16))
+
+#define JTAG_BIT(tdi, tms, tdo, d) do {					\
+    SWD_PORT->BSRR = (TDI_BR >> (((tdi) & 1) << 4)) |			\
+      (SWDIO_BR >> (((tms) & 1) << 4)) | SWCLK_BR;			\
+    delay(d);								\
+    (tdo) = ((tdo) >> 1) | ((SWD_PORT->IDR << (31 - TDO_PIN)) & 0x80000000U); \
+    SWD_PORT->BSRR = SWCLK_BS;						\
+    (tdi) >>= 1;							\
+    (tms) >>= 1;							\
+    delay(d);								\
+  } while (0)
+
+static inline __attribute__((always_inline))
+uint32_t _JTAG_Shift(uint32_t tdi, uint32_t tms, int bits, int d) {
+  int i;
+  uint32_t tdo = 0;
+  for (i = bits; i > 0; i--)
+    JTAG_BIT(tdi, tms, tdo, d);
+  SWD_PORT->BSRR = SWCLK_BR;
+  return tdo >> (32 - bits);
 }
 
-uint32_t SWD_writeMem32(uint32_t address, uint32_t *data, 
-		       uint32_t size) {
-  uint32_t len;
-  while (size) {
-    int err;
-    len = AUTO_INCREMENT_PAGE_SIZE - 
-      (address & (AUTO_INCREMENT_PAGE_SIZE - 1));
-    if (size < len)
-      len = size;
-    if ((err = _SWD_writeMem32(address, data, len)))
-      if ((err = _SWD_writeMem32(address, data, len)))
-	return err;
-    address += len;
-    data    += len/4;
-    size    -= len;
-  }
-  return 0;
+// up to 32 bits of TDI and TMS, returns what came back on TDO
+
+SWD_RAMFUNC static uint32_t JTAG_Shift(uint32_t tdi, uint32_t tms,
+				       uint8_t bits) {
+  if (swd_delay)
+    return _JTAG_Shift(tdi, tms, bits, swd_delay);
+  else
+    return _JTAG_Shift(tdi, tms, bits, 0);
 }
 
-static uint32_t _SWD_readMem32(uint32_t address, uint32_t *data, 
-			       uint32_t size) {
-  uint32_t i;
-  uint32_t tmp;
+#define JTAG_TMS(tms, bits) JTAG_Shift(~0U, (tms), (bits))
 
-  tmp = CSW_VALUE | CSW_SIZE32;
-  TRANSACTION(SW_CSW_WR, &tmp);  
-  // Write TAR register 
-  TRANSACTION(SW_TAR_WR, &address);
-  // Read first word, discard return value
-  TRANSACTION(SW_DRW_RD,data);
-  // Read data
-  for (i = 1; i < size/4; i++) 
-    TRANSACTION(SW_DRW_RD,data++);
-  // complete the transaction (last data)
-  TRANSACTION(SW_RDBUFF_RD,data);
-  return 0;
-}
+// JTAG-DP instructions and ACKs (OK and FAULT share a code)
 
-uint32_t SWD_readMem32(uint32_t address, uint32_t *data, 
-				uint32_t size) {
-  uint32_t len;
-  while (size) {
-    int err;
-    len = AUTO_INCREMENT_PAGE_SIZE - 
-      (address & (AUTO_INCREMENT_PAGE_SIZE - 1));
-    if (size < len)
-      len = size;
-    if ((err = _SWD_readMem32(address, data, len)))
-      if ((err = _SWD_readMem32(address, data, len)))
-	return err;
-    address += len;
-    data    += len/4;
-    size    -= len;
-  }
-  return 0;
-}
+#define JTAG_IR_ABORT   0x8
+#define JTAG_IR_DPACC   0xA
+#define JTAG_IR_APACC   0xB
+#define JTAG_IR_IDCODE  0xE
+#define JTAG_IR_BYPASS  0xF
+#define JTAG_IR_NONE    (~0U)
+#define JTAG_IR_BITS    4
 
-static uint32_t SWD_writeByte(uint32_t address, uint8_t data) {
-  uint32_t tmp;
-  TRANSACTION(SW_TAR_WR, &address);
-  tmp = (data) << ((address & 3) << 3);
-  TRANSACTION(SW_DRW_WR,&tmp);  
-  return 0;
-}
+#define JTAG_ACK_OK     0x2
+#define JTAG_ACK_WAIT   0x1
 
-uint32_t SWD_writeMem8(uint32_t address, uint8_t *data, uint32_t size) {
-  uint32_t tmp;
-  int err = 0;
-  // Write CSW register
+#define JTAG_RDBUFF     0x7     // RnW | A[3:2] = 0xC
 
-  tmp = CSW_VALUE | CSW_SIZE8;
-  TRANSACTION(SW_CSW_WR, &tmp);  
+/*
+ *  Position of the DAP in the scan chain, filled in by jtagChain().
+ *  The other TAPs are kept in BYPASS, their IR and DR bits are
+ *  padded with ones.
+ */
 
-  for (uint32_t i = 0; i < size; i++) {
-    // let it fail once
-    if ((err = SWD_writeByte(address + i, *data)))
-      if ((err = SWD_writeByte(address + i, *data)))
-	break;
-    data++;
-  }
+static uint32_t jtag_ir = JTAG_IR_NONE;  // instruction in the DAP
+static uint32_t jtag_ir_tdi, jtag_ir_tdo;  // IR bits on either side
+static uint32_t jtag_dr_tdi, jtag_dr_tdo;  // TAPs on either side
 
-  // reset CSW
-  if (err)
-    EPRINTF("SWD_writeMem8 failed\r\n");
-  tmp = CSW_VALUE | CSW_SIZE32;
-  TRANSACTION(SW_CSW_WR, &tmp);  
-  return err;
+static void jtagPad(uint32_t bits, bool last) {
+  for (; bits > 32; bits -= 32)
+    JTAG_Shift(~0U, 0, 32);
+  if (bits)
+    JTAG_Shift(~0U, last ? 1U << (bits - 1) : 0, bits);
 }
 
-static uint32_t SWD_readByte(uint32_t address, uint8_t *data) {
-  uint32_t tmp;
-  TRANSACTION(SW_TAR_WR, &address);
-  TRANSACTION(SW_DRW_RD,&tmp);  
-  TRANSACTION(SW_RDBUFF_RD,&tmp);
-  *data = (tmp >> ((address & 3) << 3));
-  return 0;
+SWD_RAMFUNC static void JTAG_IR(uint32_t ir) {
+  if (ir == jtag_ir)
+    return;
+  JTAG_TMS(0x3, 4);                      // Select-DR, Select-IR, Capture, Shift
+  jtagPad(jtag_ir_tdo, false);
+  JTAG_Shift(ir, jtag_ir_tdi ? 0 : 1U << (JTAG_IR_BITS - 1), JTAG_IR_BITS);
+  jtagPad(jtag_ir_tdi, true);
+  JTAG_TMS(0x1, 1);                      // Update-IR
+  jtag_ir = ir;
 }
 
-uint32_t SWD_readMem8(uint32_t address, uint8_t *data, uint32_t size) {
-  uint32_t tmp;
-  uint32_t i;
-  int err = 0;
-  // Write CSW register
-  tmp = CSW_VALUE | CSW_SIZE8;
-  for (i = 0; i < size; i++) 
-    if ((err = SWD_readByte(address + i, data + i)))
-      if ((err = SWD_readByte(address + i, data + i)))
-	break;
-  if (err)
-    EPRINTF("SWD_readMem8 failed\r\n");
-  tmp = CSW_VALUE | CSW_SIZE32;
-  TRANSACTION(SW_CSW_WR, &tmp);  
-  return err;
+// DPACC/APACC/ABORT scan, head is RnW and A[3:2]; IDCODE without head
+
+SWD_RAMFUNC static uint32_t JTAG_DR(uint32_t *head, uint32_t data) {
+  uint32_t n;
+  JTAG_TMS(0x1, 3);                      // Select-DR, Capture, Shift
+  jtagPad(jtag_dr_tdo, false);
+  if (head)
+    *head = JTAG_Shift(*head, 0, 3);
+  data = JTAG_Shift(data, jtag_dr_tdi ? 0 : 0x80000000U, 32);
+  jtagPad(jtag_dr_tdi, true);
+  JTAG_TMS(0x1, 1);                      // Update-DR
+  for (n = swd_idle; n > 32; n -= 32)    // Run-Test/Idle
+    JTAG_TMS(0, 32);
+  if (n)
+    JTAG_TMS(0, n);
+  return data;
 }
 
-int32_t SWD_Close() {
-  uint32_t tmp;
-  CoreID = 0;
-  // release debug mode 
-  SWD_writeWord(DBG_HCSR, DBGKEY);
-  // release power up
-  tmp = 0;
-  SWD_Transaction(SW_CTRLSTAT_WR, &tmp, 0);
-  SWD_Disconnect();
-  return 0;
+static inline uint32_t jtagAck(uint32_t ack) {
+  if (ack == JTAG_ACK_OK)
+    return SW_ACK_OK;
+  return (ack == JTAG_ACK_WAIT) ? SW_ACK_WAIT : 7;
 }
 
-int32_t SWD_Open() {
-  uint32_t tmp;
-  int tries;
-  
-  //  SW_ShiftReset();  
-  if (SWD_Connect(&CoreID) != SW_ACK_OK)
-    return 1;
+/*
+ *  Run an SWD request over JTAG-DP with the SWD semantics the rest
+ *  of this file expects.  The ACK of a scan belongs to the previous
+ *  access, a WAIT there means the new one was dropped and can simply
+ *  be repeated.  AP reads come back one scan late like posted SWD
+ *  reads and RDBUFF, which reads as zero, collects the last one.  DP
+ *  reads are collected straight away.  JTAG has no FAULT response:
+ *  RDBUFF reports STICKYERR/STICKYORUN from CTRL/STAT as one, and the
+ *  sticky clear bits of an ABORT write become a write-one-to-clear of
+ *  CTRL/STAT.
+ */
+
+SWD_RAMFUNC static uint32_t JTAG_Transaction(uint32_t req, uint32_t *data) {
+  uint32_t head = ((req >> 2) & 6) | ((req & SW_REQ_RnW) ? 1 : 0);
+  uint32_t ack, tmp;
+
+  _SetSWDIOasOutput();                   // TMS
+  switch (req) {
+  case SW_IDCODE_RD:
+    JTAG_IR(JTAG_IR_IDCODE);
+    *data = JTAG_DR(0, ~0U);
+    return ((*data & 1) && (*data != ~0U)) ? SW_ACK_OK : 7;
+
+  case SW_ABORT_WR:
+    if (*data & DAPABORT) {
+      JTAG_IR(JTAG_IR_ABORT);
+      head = 0;
+      JTAG_DR(&head, DAPABORT);
+    }
+    if (!(*data & (STKCMPCLR | STKERRCLR | ORUNERRCLR)))
+      return SW_ACK_OK;
+    if ((ack = JTAG_Transaction(SW_CTRLSTAT_RD, &tmp)) != SW_ACK_OK)
+      return ack;
+    tmp &= ~(STICKYCMP | STICKYERR | STICKYORUN);
+    if (*data & STKCMPCLR)
+      tmp |= STICKYCMP;
+    if (*data & STKERRCLR)
+      tmp |= STICKYERR;
+    if (*data & ORUNERRCLR)
+      tmp |= STICKYORUN;
+    return JTAG_Transaction(SW_CTRLSTAT_WR, &tmp);
+
+  case SW_RDBUFF_RD:
+    JTAG_IR(JTAG_IR_DPACC);
+    *data = JTAG_DR(&head, 0);
+    if (head != JTAG_ACK_OK)
+      return jtagAck(head);
+    if ((ack = JTAG_Transaction(SW_CTRLSTAT_RD, &tmp)) != SW_ACK_OK)
+      return ack;
+    return (tmp & (STICKYERR | STICKYORUN)) ? SW_ACK_FAULT : SW_ACK_OK;
+  }
+
+  JTAG_IR((req & SW_REQ_APnDP) ? JTAG_IR_APACC : JTAG_IR_DPACC);
+  tmp = JTAG_DR(&head, (req & SW_REQ_RnW) ? 0 : *data);
+  if (head != JTAG_ACK_OK)
+    return jtagAck(head);
+  if (!(req & SW_REQ_RnW))
+    return SW_ACK_OK;
+  if (req & SW_REQ_APnDP) {
+    *data = tmp;                         // previous AP read
+    return SW_ACK_OK;
+  }
+  head = JTAG_RDBUFF;
+  *data = JTAG_DR(&head, 0);
+  return jtagAck(head);
+}
+
+#endif
+
+static inline bool ctrlstatSelected(void);
+
+SWD_RAMFUNC static uint32_t SWD_Transaction(uint32_t req, uint32_t *data, uint32_t retry){
+  uint32_t ack   = 0;
+  // try transaction  (always at least once)
+  syssts_t sts;
+  do {  
+    SWD_RT_BEGIN(sts);
+#if SWD_USE_JTAG
+    if (swd_jtag)
+      ack = JTAG_Transaction(req, data);
+    else
+#endif
+      ack = SWD_TransactionPHY(req, data);
+    SWD_RT_END(sts);
+    if ((req == SW_CTRLSTAT_WR) && (ack == SW_ACK_OK) && ctrlstatSelected())
+      swd_dataphase = (*data & ORUNDETECT) != 0;
+    if (ack == SW_ACK_WAIT)
+      swd_stats.waits++;
+    if ((ack == SW_ACK_WAIT) && retry--)
+      continue;
+    else
+      break;
+  } while (retry);
+  return ack;   // errors handled up call chain
+}
+
+#if SWD_ORUN_WRITE
+
+/*
+ *  Stream DRW writes with overrun detection on.  The DP then expects
+ *  a data phase after every header whatever the ACK, so the ACK is
+ *  only looked at to catch a target that stopped driving the line.
+ *  WAIT and FAULT end up in STICKYORUN/STICKYERR, which the caller
+ *  checks once per page.
+ */
+
+SWD_RAMFUNC static uint32_t SWD_StreamWrite(uint32_t *data, uint32_t words) {
+  uint32_t ack;
+  syssts_t sts;
+
+  while (words--) {
+    SWD_RT_BEGIN(sts);
+    _SetSWDIOasOutput();
+    SW_ShiftOutBytes(SW_DRW_WR,1);              // Send header
+    _SetSWDIOasInput();
+    ack = (SW_ShiftIn(swd_turn + 3) >> swd_turn) & 7; // ACK, toss turnaround
+    if ((ack != SW_ACK_OK) && (ack != SW_ACK_WAIT) && (ack != SW_ACK_FAULT)) {
+      SW_ShiftInBytes(4);                       // no ack, back off
+      SW_ShiftIn(swd_turn + 1);
+      SWD_RT_END(sts);
+      return ack;
+    }
+    SW_ShiftIn(swd_turn);                       // turnaround
+    _SetSWDIOasOutput();
+    SW_ShiftOutBytes(*data,4);                  // data
+    SW_ShiftOut(Parity(*data), 1);              // parity
+    data++;
+    SW_Idle();
+    SWD_RT_END(sts);
+  }
+  _SetSWDIOasInput();
+  return SW_ACK_OK;
+}
+
+#endif
+
+/*
+ *   Access ports
+ *
+ *     APs are enumerated on connect, IDR reads until the first empty
+ *     slot or SWD_MAX_APS.  Each keeps its CSW base value, its
+ *     auto-increment page, whether it packs and its cached CSW/TAR.
+ *     SWD_SelectAP() only records the choice; SWD_Access() writes
+ *     SELECT.APSEL before the next AP access, so switching APs costs
+ *     one SELECT write.
+ */
+
+#define AP_IDR_TYPE(idr)   ((idr) & 0xF)
+#define AP_IDR_CLASS(idr)  (((idr) >> 13) & 0xF)
+#define AP_CLASS_MEM       8
+#define AP_TYPE_AHB3       1
+#define AP_TYPE_AXI        4
+#define AP_TYPE_AHB5       5
+
+typedef struct {
+  uint32_t idr;
+  uint32_t csw;        // CSW without size and increment
+  uint32_t page;       // auto-increment page
+  int32_t  packed;     // packed transfers, -1 unknown
+  uint32_t valid;      // CACHE_CSW | CACHE_TAR
+  uint32_t cache_csw;
+  uint32_t cache_tar;
+} swd_ap_t;
+
+static swd_ap_t  swd_aps[SWD_MAX_APS];
+static swd_ap_t *swd_ap = &swd_aps[0];  // selected AP
+static uint32_t  swd_apsel = 0;
+static uint32_t  swd_naps = 0;          // found on connect
+static bool      swd_ap_bad = false;    // host named an AP we can't use
+
+#define CSW_BASE (swd_ap->csw)
+#define AP_PAGE  (swd_ap->page)
+
+static void apSelect(uint32_t ap) {
+  swd_apsel = ap;
+  swd_ap    = &swd_aps[ap];
+  swd_ap_bad = false;
+}
+
+/*
+ *   DP/AP state cache
+ *
+ *     SELECT, CSW and TAR writes that would not change the register
+ *     are skipped.  TAR follows the AP's auto-increment in software
+ *     and is dropped once it leaves the auto-increment page, where
+ *     wrapping is implementation defined.  CSW and TAR are kept per
+ *     AP and only tracked while SELECT points at AP bank 0.  Errors,
+ *     line resets and dropping the power requests invalidate the
+ *     cache.
+ */
+
+#define CACHE_SELECT  1
+#define CACHE_CSW     2
+#define CACHE_TAR     4
+
+#define SELECT_APSEL  0xFF000000
+#define SELECT_APBANK 0x000000F0
+#define SELECT_DPBANK 0x0000000F
+
+static struct {
+  uint32_t valid;
+  uint32_t select;
+} swd_cache;
+
+static void cacheFlushAPs(void) {
+  for (int i = 0; i < SWD_MAX_APS; i++)
+    swd_aps[i].valid = 0;
+}
+
+static inline void cacheFlush(void) {
+  swd_cache.valid = 0;
+  cacheFlushAPs();
+}
+
+// writes to the CTRL/STAT address reach DLCR and the other DP banks
+// when SELECT says so; an unknown SELECT is taken as bank 0
+
+static inline bool ctrlstatSelected(void) {
+  return !(swd_cache.valid & CACHE_SELECT) ||
+    !(swd_cache.select & SELECT_DPBANK);
+}
+
+// the AP that SELECT points at, if its bank 0 is selected
+
+static inline swd_ap_t *cacheAP(void) {
+  uint32_t ap = swd_cache.select >> 24;
+  if (!(swd_cache.valid & CACHE_SELECT) ||
+      (swd_cache.select & SELECT_APBANK) || (ap >= SWD_MAX_APS))
+    return 0;
+  return &swd_aps[ap];
+}
+
+// account for n DRW accesses
+
+static void cacheAdvance(uint32_t n) {
+  swd_ap_t *ap = cacheAP();
+  uint32_t tar;
+  if (!ap || !(ap->valid & CACHE_TAR))
+    return;
+  if (!(ap->valid & CACHE_CSW)) {
+    ap->valid &= ~CACHE_TAR;
+    return;
+  }
+  switch (ap->cache_csw & CSW_ADDRINC) {
+  case CSW_NADDRINC:
+    return;
+  case CSW_SADDRINC:
+    tar = ap->cache_tar + (n << (ap->cache_csw & CSW_SIZE));
+    break;
+  default:                    // packed, a word at a time
+    tar = ap->cache_tar + 4*n;
+  }
+  if ((tar ^ ap->cache_tar) & ~(ap->page - 1))
+    ap->valid &= ~CACHE_TAR;
+  else
+    ap->cache_tar = tar;
+}
+
+/*
+ *  A parity error on a read only garbled the data phase.  AP and
+ *  RDBUFF results are fetched again from RESEND, which does not
+ *  repeat the access (and its side effects); other DP registers are
+ *  simply read again.
+ */
+
+#define RESEND_RETRIES 3
+
+#if SWD_AUTO_CLOCK
+static void clockError(uint32_t ack);
+#endif
+
+static uint32_t resend(uint32_t req, uint32_t *data) {
+  uint32_t ack = SW_ACK_PARITY_ERR;
+  int i;
+#if SWD_AUTO_CLOCK
+  clockError(ack);
+#endif
+  if ((req & SW_REQ_APnDP) || (req == SW_RDBUFF_RD))
+    req = SW_RESEND_RD;
+  for (i = 0; (i < RESEND_RETRIES) && (ack == SW_ACK_PARITY_ERR); i++) {
+    swd_stats.retries++;
+    ack = SWD_Transaction(req, data, MAX_SWD_RETRY);
+  }
+  return ack;
+}
+
+/*
+ *  WAIT handling
+ *
+ *     SWD_Transaction spins through the first SWD_WAIT_SPIN WAITs.
+ *     After that the thread sleeps between attempts, starting at one
+ *     system tick and doubling up to SWD_WAIT_MAX_US, until the host's
+ *     limit (SWD_SetWaitLimit, in retries) is used up.  USB and the
+ *     other threads run while a slow target catches up.
+ */
+
+#define WAIT_FIRST_US (1000000 / CH_CFG_ST_FREQUENCY)
+
+static void waitSleep(uint32_t *us) {
+  swd_stats.sleeps++;
+  chThdSleepMicroseconds(*us);
+  if (*us < SWD_WAIT_MAX_US)
+    *us <<= 1;
+}
+
+static uint32_t waitBackoff(uint32_t req, uint32_t *data, uint32_t tries) {
+  uint32_t ack = SW_ACK_WAIT;
+  uint32_t us = WAIT_FIRST_US;
+
+  for (; (ack == SW_ACK_WAIT) && (tries < swd_wait_limit); tries++) {
+    waitSleep(&us);
+    ack = SWD_Transaction(req, data, 0);
+  }
+  return ack;
+}
+
+/*
+ *  All protocol code goes through here.  retry 0 means a single
+ *  attempt (DP registers that cannot WAIT), anything else applies
+ *  the WAIT policy above.
+ */
+
+static uint32_t SWD_Access(uint32_t req, uint32_t *data, uint32_t retry) {
+  uint32_t ack;
+  uint32_t spin;
+  swd_ap_t *ap;
+
+  // point SELECT at the selected AP, keeping the banks
+
+  if ((req & SW_REQ_APnDP) && (!(swd_cache.valid & CACHE_SELECT) ||
+			       ((swd_cache.select >> 24) != swd_apsel))) {
+    uint32_t sel = swd_apsel << 24;
+    if (swd_cache.valid & CACHE_SELECT)
+      sel |= swd_cache.select & ~SELECT_APSEL;
+    if ((ack = SWD_Access(SW_SELECT_WR, &sel, retry)) != SW_ACK_OK)
+      return ack;
+  }
+
+  ap = cacheAP();
+  switch (req) {
+  case SW_SELECT_WR:
+    if ((swd_cache.valid & CACHE_SELECT) && (swd_cache.select == *data))
+      return SW_ACK_OK;
+    break;
+  case SW_CSW_WR:
+    if (ap && (ap->valid & CACHE_CSW) && (ap->cache_csw == *data))
+      return SW_ACK_OK;
+    break;
+  case SW_TAR_WR:
+    if (ap && (ap->valid & CACHE_TAR) && (ap->cache_tar == *data))
+      return SW_ACK_OK;
+    break;
+  }
+
+  spin = (swd_wait_limit < SWD_WAIT_SPIN) ? swd_wait_limit : SWD_WAIT_SPIN;
+  ack = SWD_Transaction(req, data, retry ? spin : 0);
+  if ((ack == SW_ACK_WAIT) && retry)
+    ack = waitBackoff(req, data, spin);
+  if ((ack == SW_ACK_PARITY_ERR) && (req & SW_REQ_RnW))
+    ack = resend(req, data);
+  if (ack != SW_ACK_OK) {
+    cacheFlush();
+    return ack;
+  }
+
+  switch (req) {
+  case SW_SELECT_WR:
+    swd_cache.select = *data;
+    swd_cache.valid |= CACHE_SELECT;
+    break;
+  case SW_CTRLSTAT_WR:        // dropping power requests may reset the APs
+    if (ctrlstatSelected() && ((*data & (CSYSPWRUPREQ | CDBGPWRUPREQ)) !=
+			       (CSYSPWRUPREQ | CDBGPWRUPREQ)))
+      cacheFlushAPs();
+    break;
+  case SW_CSW_WR:
+    if (ap) {
+      ap->cache_csw = *data;
+      ap->valid |= CACHE_CSW;
+    }
+    break;
+  case SW_TAR_WR:
+    if (ap) {
+      ap->cache_tar = *data;
+      ap->valid |= CACHE_TAR;
+    }
+    break;
+  case SW_DRW_RD:
+  case SW_DRW_WR:
+    cacheAdvance(1);
+    break;
+  }
+  return ack;
+}
+
+#if SWD_USE_DMA
+
+/*
+ *  TIM1 + DMA waveform generator for DRW write bursts
+ *
+ *     Each TIM1 update requests one DMA1 channel 5 transfer of a
+ *     precomputed word to the SWD port's BSRR, i.e. one half clock
+ *     period.  The data phase of a DRW write (32 data bits + parity)
+ *     is 2 words per bit plus a final clock-low word.  The CPU still
+ *     sends the header and samples the ACK; while the DMA clocks out
+ *     one word it builds the pattern for the next, and interrupts
+ *     (USB) no longer stretch the data phase.
+ */
+
+#define DMA_BITS      33
+#define DMA_PATTERN   (2 * DMA_BITS + 1)
+
+static uint32_t dma_pattern[2][DMA_PATTERN];
+
+static void DMA_BuildPattern(uint32_t *p, uint32_t data) {
+  uint32_t parity = Parity(data);
+  int i;
+  for (i = 0; i < 32; i++) {
+    *p++ = (SWDIO_BR >> ((data & 1) << 4)) | SWCLK_BR;
+    *p++ = SWCLK_BS;
+    data >>= 1;
+  }
+  *p++ = (SWDIO_BR >> (parity << 4)) | SWCLK_BR;
+  *p++ = SWCLK_BS;
+  *p   = SWCLK_BR;
+}
+
+static void _DMA_Init(void) {
+  rccEnableTIM1(FALSE);
+  rccEnableDMA1(FALSE);
+  TIM1->CR1  = 0;
+  TIM1->PSC  = 0;
+  TIM1->DIER = TIM_DIER_UDE;
+  DMA1_Channel5->CCR  = 0;
+  DMA1_Channel5->CPAR = (uint32_t) &SWD_PORT->BSRR;
+}
+
+static void _DMA_Stop(void) {
+  TIM1->CR1  = 0;
+  TIM1->DIER = 0;
+  DMA1_Channel5->CCR = 0;
+  rccDisableTIM1();
+}
+
+static void DMA_Start(const uint32_t *pattern) {
+  uint32_t half;
+
+  // half period in timer clocks for the selected SWD rate
+  half = STM32_TIMCLK1 / (2000 * swd_khz);
+  if (half < SWD_DMA_MIN_HALF)
+    half = SWD_DMA_MIN_HALF;
+  TIM1->ARR = half - 1;
+  TIM1->CNT = 0;
+
+  DMA1->IFCR = DMA_IFCR_CGIF5;
+  DMA1_Channel5->CMAR  = (uint32_t) pattern;
+  DMA1_Channel5->CNDTR = DMA_PATTERN;
+  DMA1_Channel5->CCR   = DMA_CCR_PL | DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 |
+                         DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+  TIM1->CR1 = TIM_CR1_CEN;
+}
+
+static void DMA_Wait(void) {
+  while (!(DMA1->ISR & DMA_ISR_TCIF5))
+    ;
+  TIM1->CR1 = 0;
+  DMA1_Channel5->CCR = 0;
+  DMA1->IFCR = DMA_IFCR_CGIF5;
+}
+
+/*
+ *  Write words to DRW.  Same contract as a sequence of
+ *  SWD_Transaction(SW_DRW_WR, ...) calls: WAIT is retried, anything
+ *  else that is not OK ends the burst and is returned.  *done counts
+ *  the words that were ACKed.
+ */
+
+static uint32_t SWD_WriteBurstDMA(uint32_t *data, uint32_t words,
+				  uint32_t *done) {
+  uint32_t i;
+  uint32_t ack = SW_ACK_OK;
+  uint32_t tries, us;
+  syssts_t sts;
+
+  *done = 0;
+  if (words == 0)
+    return SW_ACK_OK;
+  DMA_BuildPattern(dma_pattern[0], data[0]);
+  for (i = 0; i < words; i++) {
+    tries = 0;
+    us = WAIT_FIRST_US;
+    for (;;) {
+      SWD_RT_BEGIN(sts);
+      _SetSWDIOasOutput();
+      SW_ShiftOutBytes(SW_DRW_WR,1);           // Send header
+      _SetSWDIOasInput();
+      ack = (SW_ShiftIn(swd_turn + 3) >> swd_turn) & 7; // ACK, toss turnaround
+      if (ack == SW_ACK_WAIT)
+	swd_stats.waits++;
+      if ((ack == SW_ACK_WAIT) || (ack == SW_ACK_FAULT)) {
+	SW_NoData(SW_DRW_WR);
+      } else if (ack != SW_ACK_OK) {           // no ack, back off data phase
+	SW_ShiftInBytes(4);
+	SW_ShiftIn(swd_turn + 1);
+      }
+      if (ack != SW_ACK_OK)
+	SWD_RT_END(sts);
+      if ((ack != SW_ACK_WAIT) || (++tries > swd_wait_limit))
+	break;
+      if (tries >= SWD_WAIT_SPIN)              // same policy as SWD_Access
+	waitSleep(&us);
+    }
+    if (ack != SW_ACK_OK)
+      break;
+    SW_ShiftIn(swd_turn);                      // turnaround
+    _SetSWDIOasOutput();
+    DMA_Start(dma_pattern[i & 1]);             // data + parity
+    if (i + 1 < words)
+      DMA_BuildPattern(dma_pattern[(i + 1) & 1], data[i + 1]);
+    DMA_Wait();
+    SW_Idle();
+    SWD_RT_END(sts);
+    *done = i + 1;
+  }
+  _SetSWDIOasInput();
+  return ack;
+}
+
+#endif
+
+static void SW_ShiftReset(void){
+  SW_ShiftOutBytes(0xffffffff, 4);
+  SW_ShiftOutBytes(0xffffffff, 3);
+}
+
+/*
+ *   Multidrop (DPv2)
+ *
+ *     With a target selected, SWD_Connect takes the DPs through the
+ *     dormant state into SWD and every line reset is followed by a
+ *     TARGETSEL write, which no DP acknowledges, before the IDCODE
+ *     read.  Each target keeps its IDCODE, SELECT and turnaround, so
+ *     switching between connected targets costs a line reset.  The
+ *     AP table is shared: targets on one bus are expected to be the
+ *     same part.
+ */
+
+typedef struct {
+  uint32_t targetsel;   // TARGETID | TINSTANCE << 28
+  uint32_t idcode;      // 0 until connected
+  uint32_t select;
+  uint32_t valid;       // CACHE_SELECT
+  uint32_t turn;
+} swd_target_t;
+
+static swd_target_t  swd_targets[SWD_MAX_TARGETS];
+static swd_target_t *swd_target = 0;    // 0 for point to point
+
+static void SW_TargetSel(uint32_t id) {
+  _SetSWDIOasOutput();
+  SW_ShiftOutBytes(SW_TARGETSEL_WR,1);   // Send header
+  _SetSWDIOasInput();
+  SW_ShiftIn(2*swd_turn + 3);            // nobody drives the ACK
+  _SetSWDIOasOutput();
+  SW_ShiftOutBytes(id,4);                // data
+  SW_ShiftOut(Parity(id), 1);            // parity
+}
+
+// selection alert and SWD activation code, ADIv5.2 B5.3.4
+
+static void SW_DormantToSWD(void) {
+  static const uint32_t alert[4] = {
+    0x6209F392, 0x86852D95, 0xE3DDAFE9, 0x19BC0EA2
+  };
+  int i;
+  SW_ShiftOutBytes(0xff, 1);
+  for (i = 0; i < 4; i++)
+    SW_ShiftOutBytes(alert[i], 4);
+  SW_ShiftOut(0, 4);
+  SW_ShiftOutBytes(0x1A, 1);
+}
+
+#if SWD_USE_JTAG
+
+/*
+ *  Find the DAP in the scan chain.  After Test-Logic-Reset every TAP
+ *  has IDCODE (32 bits, bit 0 set) or BYPASS (a single 0) in DR, so
+ *  one DR scan counts the TAPs on either side of the ARM DAP.  The
+ *  IR scan only measures the total IR length, so the other TAPs must
+ *  all be on one side of the DAP (as on the STM32F1).  Leaves every
+ *  TAP in BYPASS.
+ */
+
+#define JTAG_MAX_TAPS   8
+#define JTAG_ARM_ID(id) ((((id) >> 1) & 0x7FF) == 0x23B)
+
+static uint32_t jtagChain(void) {
+  uint32_t dap = JTAG_MAX_TAPS;
+  uint32_t n, id, len;
+
+  JTAG_TMS(0x1F, 6);                     // Test-Logic-Reset, Run-Test/Idle
+  JTAG_TMS(0x1, 3);                      // Shift-DR
+  for (n = 0; n < JTAG_MAX_TAPS; n++) {
+    if (!(JTAG_Shift(~0U, 0, 1) & 1))
+      continue;                          // BYPASS
+    id = (JTAG_Shift(~0U, 0, 31) << 1) | 1;
+    if (id == ~0U)                       // our own ones, end of chain
+      break;
+    if ((dap == JTAG_MAX_TAPS) && JTAG_ARM_ID(id))
+      dap = n;
+  }
+  JTAG_TMS(0x3, 3);                      // Exit1, Update, Run-Test/Idle
+
+  JTAG_TMS(0x3, 4);                      // Shift-IR
+  JTAG_Shift(0, 0, 32);
+  JTAG_Shift(0, 0, 32);
+  for (len = 0; len < 64; len++)
+    if (JTAG_Shift(~0U, 0, 1) & 1)
+      break;
+  JTAG_TMS(0x3, 3);                      // all BYPASS, Run-Test/Idle
+  jtag_ir = JTAG_IR_BYPASS;
+
+  if ((dap >= n) || (len < JTAG_IR_BITS) || (len >= 64))
+    return 1;
+  jtag_dr_tdo = dap;
+  jtag_dr_tdi = n - dap - 1;
+  if (jtag_dr_tdo && jtag_dr_tdi && (len > JTAG_IR_BITS))
+    return 1;
+  jtag_ir_tdo = jtag_dr_tdo ? len - JTAG_IR_BITS : 0;
+  jtag_ir_tdi = len - JTAG_IR_BITS - jtag_ir_tdo;
+  EPRINTF("jtag %d taps, dap %d, ir %d\r\n", n, dap, len);
+  return 0;
+}
+
+static uint32_t JTAG_LineReset(uint32_t *idcode) {
+  _SetSWDIOasOutput();
+  JTAG_TMS(0x1F, 6);                     // Test-Logic-Reset, Run-Test/Idle
+  jtag_ir = JTAG_IR_NONE;
+  cacheFlush();
+  return SWD_Transaction(SW_IDCODE_RD, idcode, 0);
+}
+
+static uint32_t JTAG_Connect(uint32_t *idcode) {
+  osalDbgAssert((PAL_PORT(LINE_TGT_TDI) == SWD_PORT) &&
+		(PAL_PORT(LINE_TGT_TDO) == SWD_PORT),
+		"TDI and TDO not on the SWD port");
+  palSetLine(LINE_TGT_TDI);
+  toOutput(LINE_TGT_TDI);
+  toInput(LINE_TGT_TDO);
+  // SWJ-DP: switch to JTAG
+  _SetSWDIOasOutput();
+  SW_ShiftReset();
+  SW_ShiftOutBytes(0xE73C,2);
+  SW_ShiftReset();
+  if (jtagChain())
+    return 7;
+  return JTAG_LineReset(idcode);
+}
+
+#endif
+
+uint32_t SWD_LineReset(uint32_t *idcode){
+  uint32_t ack;
+
+  // SWD reset sequence:  
+  //          56 1's, 8 0's, Read IDcode
+  //          SW_IDCODE_RD not allowed to wait or fault
+#if SWD_USE_JTAG
+  if (swd_jtag)
+    return JTAG_LineReset(idcode);
+#endif
+  _SetSWDIOasOutput();
+  SW_ShiftReset();  
+  SW_ShiftOutBytes(0,1);
+  cacheFlush();
+  if (swd_target)
+    SW_TargetSel(swd_target->targetsel);
+  ack = SWD_Transaction(SW_IDCODE_RD, idcode, 0);
+  return ack;
+}
+
+static uint32_t SWD_Connect(uint32_t *idcode){
+  // Init Pins 
+  _SetSWPinsIdle(); 
+  swd_dataphase = false;          // _SWD_Open sets CTRL/STAT afresh
+#if SWD_USE_SPI
+  _SPI_Init();
+#endif
+#if SWD_USE_DMA
+  _DMA_Init();
+#endif
+#if SWD_USE_JTAG
+  if (swd_jtag)
+    return JTAG_Connect(idcode);
+#endif
+  // Select SWD Port
+  _SetSWDIOasOutput();
+  SW_ShiftReset();              
+  if (swd_target) {
+    // multidrop DPs only leave dormant on the selection alert.  An
+    // SWJ-DP left in JTAG by SWD_Disconnect needs JTAG-to-dormant,
+    // one in SWD state SWD-to-dormant; send both
+    SW_ShiftOut(0x33BBBBBA,31);
+    SW_ShiftReset();
+    SW_ShiftOutBytes(0xE3BC,2);
+    SW_DormantToSWD();
+  } else
+    SW_ShiftOutBytes(0xE79E,2);
+  // Finish with Line reset
+  return SWD_LineReset(idcode); 
+}
+
+/*
+ *  Select the multidrop target for the following commands, 0 goes
+ *  back to point to point.  A target that was connected before is
+ *  reselected and checked against its IDCODE, returned in *idcode;
+ *  a new one reads 0 there and is connected by SWD_Open.
+ */
+
+uint32_t SWD_SelectTarget(uint32_t targetsel, uint32_t *idcode) {
+  swd_target_t *t = 0;
+  uint32_t tmp;
+  int i;
+
+  *idcode = 0;
+  if (swd_target) {
+    swd_target->idcode = CoreID;
+    swd_target->select = swd_cache.select;
+    swd_target->valid  = swd_cache.valid & CACHE_SELECT;
+    swd_target->turn   = swd_turn;
+  }
+  CoreID = 0;
+  swd_parked = 0;
+  swd_timedout = false;
+  swd_target = 0;
+  if (targetsel == 0)
+    return 0;
+  for (i = 0; (i < SWD_MAX_TARGETS) && !t; i++)
+    if (swd_targets[i].targetsel == targetsel)
+      t = &swd_targets[i];
+  for (i = 0; (i < SWD_MAX_TARGETS) && !t; i++)
+    if (swd_targets[i].targetsel == 0) {
+      t = &swd_targets[i];
+      t->targetsel = targetsel;
+      t->idcode = 0;
+      t->turn = 1;
+    }
+  if (!t)
+    return 1;
+  swd_target = t;
+  swd_turn = t->turn;
+  rtCheck();
+  if (t->idcode == 0)
+    return 0;
+  if ((SWD_LineReset(&tmp) != SW_ACK_OK) || (tmp != t->idcode)) {
+    t->idcode = 0;
+    return 1;
+  }
+  swd_cache.select = t->select;
+  swd_cache.valid  = t->valid;
+  CoreID = *idcode = tmp;
+  return 0;
+}
+
+static void SWD_Disconnect(void){
+ // set pins to idle state
+  _SetSWPinsIdle(); 
+ // select JTAG port
+  _SetSWDIOasOutput();
+  SW_ShiftReset();  
+  SW_ShiftOutBytes(0xE73C,2);
+  SW_ShiftReset();  
+  // Release pins (except nReset)
+  _ResetDebugPins();
+#if SWD_USE_SPI
+  _SPI_Stop();
+#endif
+#if SWD_USE_DMA
+  _DMA_Stop();
+#endif
+}
+
+/*
+ *   Clock control
+ *
+ *     SWD_SetFreq picks the fastest setting that does not exceed the
+ *     requested rate (the slowest one if nothing does) and returns
+ *     the rate actually achieved in kHz.  That setting is also the
+ *     ceiling for the automatic tuning below.  With SPI the achieved
+ *     rate is the SCK the data phases run at, which is what the rate
+ *     table reports too.
+ */
+
+static void setClock(uint32_t i) {
+  swd_clock = i;
+  swd_delay = swd_clocks[i].delay;
+  swd_khz   = swd_clocks[i].khz;
+#if SWD_USE_SPI
+  // SPI phases run at the highest SCK not above the selected rate,
+  // slower rates than SPI1 can reach fall back to bit-banging
+  spi_br = SPI_BR_FOR(swd_khz);
+  spi_on = SPI_REACHES(swd_khz);
+#endif
+  rtCheck();
+}
+
+uint32_t SWD_SetFreq(uint32_t khz) {
+  uint32_t i;
+  for (i = 0; i < SWD_CLOCKS - 1; i++)
+    if (clockKHz(i) <= khz)
+      break;
+  swd_ceiling = i;
+  setClock(i);
+  return clockKHz(i);
+}
+
+/*
+ *   Read sample phase
+ *
+ *     Delay, in CPU cycles, from the rising SWCLK edge to the SWDIO
+ *     sample; 0 samples before the edge as usual.  Rounded up to
+ *     whole delay loops and limited to half a clock period at the
+ *     slowest rate (about 4800 cycles); returns the delay actually
+ *     used.  Applies to the bit-banged phases only, SPI1 samples on
+ *     its own edge.
+ */
+
+#define SAMPLE_MAX (swd_clocks[SWD_CLOCKS - 1].delay)   // delay loops
+
+uint32_t SWD_SetSampleDelay(uint32_t cycles) {
+  if (cycles > SAMPLE_MAX * DELAY_CYCLES)
+    cycles = SAMPLE_MAX * DELAY_CYCLES;
+  swd_sample = (cycles + DELAY_CYCLES - 1) / DELAY_CYCLES;
+  rtCheck();
+  return swd_sample * DELAY_CYCLES;
+}
+
+uint32_t SWD_GetFreq(void) {
+  return clockKHz(swd_clock);
+}
+
+// Copy the supported rates (kHz, fastest first), return the count
+
+uint32_t SWD_GetFreqTable(uint32_t *khz, uint32_t max) {
+  uint32_t i;
+  for (i = 0; i < SWD_CLOCKS && i < max; i++)
+    khz[i] = clockKHz(i);
+  return i;
+}
+
+/*
+ *   Public Debug Port access functions
+ *     TRANSACTION macro used to catch errors and
+ *     clear error condition
+ */
+
+#define TRANSACTION(reg,op) \
+  do { int ack = errorClear(SWD_Access(reg,op,MAX_SWD_RETRY)); \
+    if (ack) { \
+      EPRINTF("trans fail %d reg %x op %x\r\n", ack, reg, op);	\
+      return ack; \
+    }} while (0)
+
+/*
+ *   Automatic clock tuning
+ *
+ *     SWD_Open starts at the ceiling and steps down until a connect
+ *     and clockTest() both pass.  At run time errorClear() counts
+ *     parity and no-ACK errors; SWD_CLOCK_ERRORS of them within
+ *     SWD_CLOCK_WINDOW good transactions step the clock down one
+ *     setting.
+ */
+
+#if SWD_AUTO_CLOCK
+static uint32_t swd_errors = 0;
+static uint32_t swd_good   = 0;
+static bool     swd_tuning = false;
+
+static void clockError(uint32_t ack) {
+  if (ack == SW_ACK_OK) {
+    if (++swd_good >= SWD_CLOCK_WINDOW)
+      swd_good = swd_errors = 0;
+    return;
+  }
+  if (swd_tuning || ((ack != SW_ACK_PARITY_ERR) && (ack != 7)))
+    return;
+  if ((++swd_errors >= SWD_CLOCK_ERRORS) && (swd_clock + 1 < SWD_CLOCKS)) {
+    EPRINTF("swd clock down to %d kHz\r\n", swd_clocks[swd_clock + 1].khz);
+    setClock(swd_clock + 1);
+    swd_good = swd_errors = 0;
+  }
+}
+#endif
+
+static uint32_t errorClear(uint32_t ack){
+  uint32_t tmp;
+#if SWD_AUTO_CLOCK
+  clockError(ack);
+#endif
+  if (ack == SW_ACK_OK)
+    return 0;
+  cacheFlush();
+  if (ack == SW_ACK_WAIT)
+    swd_timedout = true;
+
+  // parity error requires no special clearing
+
+  if (ack == SW_ACK_PARITY_ERR)
+    return 1;
+
+  // Read CSR if this fails, we need to do a line reset 
+
+  if (ack == 7) {  // nothing came back !
+    EPRINTF("transaction returned 7\r\n");
+    return 1;
+  }
+
+  EPRINTF("Error clear %d\r\n", ack);
+  if (SW_ACK_OK != SWD_Transaction(SW_CTRLSTAT_RD, &tmp, 0))  {
+    EPRINTF("Error clear line reset\r\n");
+    SWD_LineReset(&tmp);
+  } 
+ 
+  // clear error/sticky bits in abort reg
+  // if this fails, we're truly wedged
+
+  tmp = (STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR);
+  if (SW_ACK_OK != SWD_Transaction(SW_ABORT_WR, &tmp,0)) {
+    EPRINTF("Clear sticky bits failed !\r\n");
+    return 2;
+  }
+
+
+  // set CSW to 32-bit, autoinc
+  // this better not fail !
+
+  tmp = CSW_BASE | CSW_SADDRINC | CSW_SIZE32;
+  if (SW_ACK_OK != SWD_Access(SW_CSW_WR, &tmp, MAX_SWD_RETRY))
+    return 2;
+  return 1;
+}
+
+#if SWD_ORUN_WRITE
+
+/*
+ *   Sticky overrun block writes
+ *
+ *     SWD_writeMem32 turns ORUNDETECT on for the whole call and the
+ *     pages are streamed with SWD_StreamWrite().  A page is checked
+ *     once, by draining the last write through RDBUFF and reading
+ *     CTRL/STAT.  On any failure ORUNDETECT goes off and the page is
+ *     retried, and the rest of the call written, one ACK at a time.
+ *     The other accesses made meanwhile (CSW, TAR, RDBUFF) get their
+ *     WAIT/FAULT data phase from the PHY, see SW_NoData().
+ */
+
+static bool swd_orun = false;
+
+static uint32_t orunDetect(bool on) {
+  uint32_t tmp;
+  tmp = CSYSPWRUPREQ | CDBGPWRUPREQ | TRNNORMAL | MASKLANE;
+  if (on)
+    tmp |= ORUNDETECT;
+  TRANSACTION(SW_CTRLSTAT_WR, &tmp);
+  return 0;
+}
+
+// ORUNDETECT off again if this call turned it on
+
+static uint32_t orunEnd(void) {
+  if (!swd_orun)
+    return 0;
+  swd_orun = false;
+  return orunDetect(false);
+}
+
+static uint32_t orunWrite(uint32_t *data, uint32_t words) {
+  uint32_t ack;
+  uint32_t tmp;
+
+  ack = SWD_StreamWrite(data, words);
+  if (ack == SW_ACK_OK)
+    ack = SWD_Access(SW_RDBUFF_RD, &tmp, MAX_SWD_RETRY);
+  if ((ack == SW_ACK_OK) || (ack == SW_ACK_FAULT)) {
+    if (SWD_Transaction(SW_CTRLSTAT_RD, &tmp, 0) != SW_ACK_OK)
+      return 7;
+    if (tmp & (STICKYORUN | STICKYERR)) {
+      EPRINTF("orun write stat 0x%x\r\n", tmp);
+      ack = SW_ACK_FAULT;
+    }
+  }
+  return ack;
+}
+
+#endif
+
+/*
+ *   Block transfers
+ *
+ *     _SWD_writeMem32/_SWD_readMem32 move one auto-increment page and
+ *     count the words (elements for the narrow routines) that went
+ *     through in *done.  When one fails,
+ *     blockDone() bounds that count by where TAR stopped and the page
+ *     loop carries on from the first word not known to be good, after
+ *     the error clear done by TRANSACTION.  Two failures in a row
+ *     without progress end the transfer.
+ */
+
+static uint32_t blockDone(uint32_t address, uint32_t count, uint32_t shift) {
+  uint32_t tar;
+  if ((SWD_Access(SW_TAR_RD, &tar, MAX_SWD_RETRY) != SW_ACK_OK) ||
+      (SWD_Access(SW_RDBUFF_RD, &tar, MAX_SWD_RETRY) != SW_ACK_OK) ||
+      (tar < address))
+    return 0;
+  tar = (tar - address) >> shift;
+  swd_stats.retries++;
+  EPRINTF("resume 0x%x after %d/%d words\r\n", address, tar, count);
+  return (tar < count) ? tar : count;
+}
+
+static uint32_t _SWD_writeMem32(uint32_t address, uint32_t *data, 
+				uint32_t size, uint32_t *done) {
+  uint32_t i;
+  uint32_t tmp;
+
+  *done = 0;
+  tmp = CSW_BASE | CSW_SADDRINC | CSW_SIZE32;
+  TRANSACTION(SW_CSW_WR, &tmp);  
+  // Write TAR register 
+  TRANSACTION(SW_TAR_WR, &address);
+  // Write data
+#if SWD_ORUN_WRITE
+  if (swd_orun) {
+    *done = size/4;      // TAR tells how far it really got
+    if ((i = errorClear(orunWrite(data, size/4)))) {
+      orunEnd();
+      return i;
+    }
+    cacheAdvance(size/4);
+    return 0;
+  }
+#endif
+#if SWD_USE_DMA
+  if (!swd_jtag) {
+    if ((i = errorClear(SWD_WriteBurstDMA(data, size/4, done)))) {
+      EPRINTF("dma write fail %d\r\n", i);
+      return i;
+    }
+    cacheAdvance(size/4);
+  } else
+#endif
+  for (i = 0; i < size/4; i++) {
+    TRANSACTION(SW_DRW_WR,data++);
+    *done = i + 1;
+  }
+  // dummy read to flush transaction
+  TRANSACTION(SW_RDBUFF_RD,&tmp);
+  return 0;
+}
+
+uint32_t SWD_writeMem32(uint32_t address, uint32_t *data, 
+		       uint32_t size) {
+  uint32_t len;
+  uint32_t done;
+  int stall = 0;
+  if (swd_ap_bad)
+    return 1;
+#if SWD_ORUN_WRITE
+  swd_orun = (size > 4) && !swd_jtag && !orunDetect(true);
+#endif
+  while (size) {
+    int err;
+    len = AP_PAGE - (address & (AP_PAGE - 1));
+    if (size < len)
+      len = size;
+    if ((err = _SWD_writeMem32(address, data, len, &done)))
+      if (!(done = blockDone(address, done, 2)) && stall++) {
+#if SWD_ORUN_WRITE
+	orunEnd();
+#endif
+	return err;
+      }
+    if (done)
+      stall = 0;
+    address += done*4;
+    data    += done;
+    size    -= done*4;
+  }
+#if SWD_ORUN_WRITE
+  return orunEnd();
+#else
+  return 0;
+#endif
+}
+
+static uint32_t _SWD_readMem32(uint32_t address, uint32_t *data, 
+			       uint32_t size, uint32_t *done) {
+  uint32_t i;
+  uint32_t tmp;
+
+  *done = 0;
+  tmp = CSW_BASE | CSW_SADDRINC | CSW_SIZE32;
+  TRANSACTION(SW_CSW_WR, &tmp);  
+  // Write TAR register 
+  TRANSACTION(SW_TAR_WR, &address);
+  // Read first word, discard return value
+  TRANSACTION(SW_DRW_RD,data);
+  // Read data
+  for (i = 1; i < size/4; i++) {
+    TRANSACTION(SW_DRW_RD,data++);
+    *done = i;
+  }
+  // complete the transaction (last data)
+  TRANSACTION(SW_RDBUFF_RD,data);
+  *done = size/4;
+  return 0;
+}
+
+uint32_t SWD_readMem32(uint32_t address, uint32_t *data, 
+				uint32_t size) {
+  uint32_t len;
+  uint32_t done;
+  int stall = 0;
+  if (swd_ap_bad)
+    return 1;
+  while (size) {
+    int err;
+    len = AP_PAGE - (address & (AP_PAGE - 1));
+    if (size < len)
+      len = size;
+    if ((err = _SWD_readMem32(address, data, len, &done)))
+      if (!(done = blockDone(address, done, 2)) && stall++)
+	return err;
+    if (done)
+      stall = 0;
+    address += done*4;
+    data    += done;
+    size    -= done*4;
+  }
+  return 0;
+}
+
+/*
+ *   Narrow block writes
+ *
+ *     Bytes (and halfwords) go out with CSW set to the element size
+ *     and auto-increment on, each element in its own byte lane, and
+ *     TAR written once per page.  Where the AP implements packed
+ *     transfers, probed once per connection, one DRW write carries
+ *     all the elements of a word.  Packed lanes wrap modulo 4, so
+ *     only whole aligned words are packed; an unaligned head and a
+ *     partial last word are written element by element.  Strict
+ *     mode never packs.
+ */
+
+static uint32_t swd_strict8 = 0;        // byte accesses only
+
+static bool packedOK(void) {
+  uint32_t tmp;
+  if (swd_strict8)
+    return false;
+  if (swd_ap->packed < 0) {
+    swd_ap->packed = 0;
+    tmp = CSW_BASE | CSW_PADDRINC | CSW_SIZE8;
+    if ((SWD_Access(SW_CSW_WR, &tmp, MAX_SWD_RETRY) == SW_ACK_OK) &&
+	(SWD_Access(SW_CSW_RD, &tmp, MAX_SWD_RETRY) == SW_ACK_OK) &&
+	(SWD_Access(SW_RDBUFF_RD, &tmp, MAX_SWD_RETRY) == SW_ACK_OK))
+      swd_ap->packed = ((tmp & CSW_ADDRINC) == CSW_PADDRINC);
+    EPRINTF("AP %d packed transfers %d\r\n", swd_apsel, swd_ap->packed);
+  }
+  return swd_ap->packed;
+}
+
+// one page of bytes, width 1 or 2, *done in bytes
+
+static uint32_t _SWD_writeNarrow(uint32_t address, uint8_t *data,
+				 uint32_t size, uint32_t width,
+				 uint32_t *done) {
+  uint32_t tmp, stop;
+  uint32_t csize = (width == 1) ? CSW_SIZE8 : CSW_SIZE16;
+  uint32_t end   = address + size;
+  uint32_t head  = (address + 3) & ~3;     // first aligned word
+  uint32_t packed = end & ~3;              // end of the aligned words
+
+  if ((head >= packed) || !packedOK())
+    head = packed = end;
+  *done = 0;
+  while (address < end) {
+    if ((address == head) && (address < packed)) {
+      tmp = CSW_BASE | CSW_PADDRINC | csize;
+      TRANSACTION(SW_CSW_WR, &tmp);
+      TRANSACTION(SW_TAR_WR, &address);
+      while (address < packed) {
+	tmp = 0;
+	do {
+	  tmp |= *data++ << ((address & 3) << 3);
+	} while (++address & 3);
+	TRANSACTION(SW_DRW_WR, &tmp);
+	*done = size - (end - address);
+      }
+      continue;
+    }
+    stop = (address < head) ? head : end;
+    tmp = CSW_BASE | CSW_SADDRINC | csize;
+    TRANSACTION(SW_CSW_WR, &tmp);
+    TRANSACTION(SW_TAR_WR, &address);
+    while (address < stop) {
+      tmp = data[0] << ((address & 3) << 3);
+      if (width == 2)
+	tmp |= data[1] << (((address & 3) + 1) << 3);
+      TRANSACTION(SW_DRW_WR, &tmp);
+      data    += width;
+      address += width;
+      *done = size - (end - address);
+    }
+  }
+  // dummy read to flush transaction
+  TRANSACTION(SW_RDBUFF_RD, &tmp);
+  return 0;
+}
+
+static uint32_t writeNarrow(uint32_t address, uint8_t *data, uint32_t size,
+			    uint32_t width) {
+  uint32_t len;
+  uint32_t done;
+  int stall = 0;
+  if (swd_ap_bad)
+    return 1;
+  while (size) {
+    int err;
+    len = AP_PAGE - (address & (AP_PAGE - 1));
+    if (size < len)
+      len = size;
+    if ((err = _SWD_writeNarrow(address, data, len, width, &done))) {
+      if (!(done = blockDone(address, done, 0) & ~(width - 1)) && stall++) {
+	EPRINTF("narrow write failed\r\n");
+	return err;
+      }
+    }
+    if (done)
+      stall = 0;
+    address += done;
+    data    += done;
+    size    -= done;
+  }
+  return 0;
+}
+
+uint32_t SWD_writeMem8(uint32_t address, uint8_t *data, uint32_t size) {
+  return writeNarrow(address, data, size, 1);
+}
+
+uint32_t SWD_writeMem16(uint32_t address, uint8_t *data, uint32_t size) {
+  if ((address | size) & 1)
+    return 1;
+  return writeNarrow(address, data, size, 2);
+}
+
+/*
+ *   Narrow block reads
+ *
+ *     Same scheme as the writes without packing: CSW at the element
+ *     size with auto-increment, TAR once per page, reads pipelined
+ *     through DRW and each element taken from its byte lane.
+ */
+
+static uint32_t _SWD_readNarrow(uint32_t address, uint8_t *data,
+				uint32_t size, uint32_t width,
+				uint32_t *done) {
+  uint32_t tmp;
+  uint32_t i;
+  uint32_t n = size / width;
+
+  *done = 0;
+  tmp = CSW_BASE | CSW_SADDRINC | ((width == 1) ? CSW_SIZE8 : CSW_SIZE16);
+  TRANSACTION(SW_CSW_WR, &tmp);
+  TRANSACTION(SW_TAR_WR, &address);
+  // Read first element, discard return value
+  TRANSACTION(SW_DRW_RD, &tmp);
+  for (i = 1; i <= n; i++) {
+    if (i < n)
+      TRANSACTION(SW_DRW_RD, &tmp);
+    else
+      TRANSACTION(SW_RDBUFF_RD, &tmp);
+    tmp >>= (address & 3) << 3;
+    *data++ = tmp;
+    if (width == 2)
+      *data++ = tmp >> 8;
+    address += width;
+    *done = i * width;
+  }
+  return 0;
+}
+
+static uint32_t readNarrow(uint32_t address, uint8_t *data, uint32_t size,
+			   uint32_t width) {
+  uint32_t len;
+  uint32_t done;
+  int stall = 0;
+  if (swd_ap_bad)
+    return 1;
+  while (size) {
+    int err;
+    len = AP_PAGE - (address & (AP_PAGE - 1));
+    if (size < len)
+      len = size;
+    if ((err = _SWD_readNarrow(address, data, len, width, &done))) {
+      if (!(done = blockDone(address, done, 0) & ~(width - 1)) && stall++) {
+	EPRINTF("narrow read failed\r\n");
+	return err;
+      }
+    }
+    if (done)
+      stall = 0;
+    address += done;
+    data    += done;
+    size    -= done;
+  }
+  return 0;
+}
+
+uint32_t SWD_readMem16(uint32_t address, uint8_t *data, uint32_t size) {
+  if ((address | size) & 1)
+    return 1;
+  return readNarrow(address, data, size, 2);
+}
+
+/*
+ *   Any alignment
+ *
+ *     SWD_readMem/SWD_writeMem split a range into a narrow head, word
+ *     bursts for the aligned middle and a narrow tail, each edge in
+ *     the widest accesses its alignment allows.  The middle is read
+ *     into the start of data and moved up into place.  A write goes
+ *     out in address order; the middle is moved down over the head
+ *     for the burst and moved back after, so the caller's buffer
+ *     comes back unchanged.  Both need data word aligned and fall
+ *     back to bytes otherwise.
+ */
+
+static uint32_t readEdge(uint32_t address, uint8_t *data, uint32_t size) {
+  uint32_t n, err;
+  for (; size; address += n, data += n, size -= n) {
+    n = ((address & 1) || (size < 2)) ? 1 : 2;
+    if ((err = readNarrow(address, data, n, n)))
+      return err;
+  }
+  return 0;
+}
+
+static uint32_t writeEdge(uint32_t address, uint8_t *data, uint32_t size) {
+  uint32_t n, err;
+  for (; size; address += n, data += n, size -= n) {
+    n = ((address & 1) || (size < 2)) ? 1 : 2;
+    if ((err = writeNarrow(address, data, n, n)))
+      return err;
+  }
+  return 0;
+}
+
+uint32_t SWD_readMem(uint32_t address, uint8_t *data, uint32_t size) {
+  uint32_t head, words;
+  uint32_t err;
+
+  if ((uint32_t) data & 3)
+    return readNarrow(address, data, size, 1);
+  head = (4 - (address & 3)) & 3;
+  if (head > size)
+    head = size;
+  words = (size - head)/4;
+  if (words) {
+    if ((err = SWD_readMem32(address + head, (uint32_t *) data, words*4)))
+      return err;
+    if (head)
+      memmove(data + head, data, words*4);
+  }
+  if ((err = readEdge(address, data, head)))
+    return err;
+  return readEdge(address + head + words*4, data + head + words*4,
+		  size - head - words*4);
+}
+
+uint32_t SWD_writeMem(uint32_t address, uint8_t *data, uint32_t size) {
+  uint32_t head, words;
+  uint32_t err;
+  uint8_t save[3];
+
+  if ((uint32_t) data & 3)
+    return writeNarrow(address, data, size, 1);
+  head = (4 - (address & 3)) & 3;
+  if (head > size)
+    head = size;
+  words = (size - head)/4;
+  if ((err = writeEdge(address, data, head)))
+    return err;
+  if (words) {
+    if (head) {
+      memcpy(save, data, head);
+      memmove(data, data + head, words*4);
+    }
+    err = SWD_writeMem32(address + head, (uint32_t *) data, words*4);
+    if (head) {
+      memmove(data + head, data, words*4);
+      memcpy(data, save, head);
+    }
+    if (err)
+      return err;
+  }
+  return writeEdge(address + head + words*4, data + head + words*4,
+		   size - head - words*4);
+}
+
+// byte reads are packed into words unless the host wants strict access
+
+uint32_t SWD_readMem8(uint32_t address, uint8_t *data, uint32_t size) {
+  if (swd_strict8)
+    return readNarrow(address, data, size, 1);
+  return SWD_readMem(address, data, size);
+}
+
+uint32_t SWD_SetStrictBytes(uint32_t strict) {
+  swd_strict8 = strict;
+  return 0;
+}
+
+/*
+ *   Transfer lists
+ *
+ *     SWD_Transfer() runs an array of DP/AP accesses in one loop.
+ *     Writes send data, reads return into data.  A read with a
+ *     non-zero mask is repeated (up to REGRETRIES times) until
+ *     (value & mask) == (data & mask).  AP reads are posted; the loop
+ *     collects each result from the next AP read or from RDBUFF, so
+ *     the caller never sees the pipeline.  On error the index of the
+ *     failing entry goes to *fail.
+ */
+
+static inline uint32_t xferOne(uint32_t req, uint32_t *data) {
+  uint32_t ack = SWD_Access(req, data, MAX_SWD_RETRY);
+#if SWD_AUTO_CLOCK
+  if (ack == SW_ACK_OK)
+    clockError(ack);
+#endif
+  return ack;
+}
+
+static uint32_t xferFail(uint32_t ack, uint32_t i, uint32_t *fail) {
+  EPRINTF("transfer fail %d entry %d\r\n", ack, i);
+  if (fail)
+    *fail = i;
+  if (ack != SW_XFER_MISMATCH)
+    errorClear(ack);
+  return ack;
+}
+
+#define SW_REQ_APRD (SW_REQ_APnDP | SW_REQ_RnW)
+
+uint32_t SWD_Transfer(swd_xfer_t *list, uint32_t count, uint32_t *fail) {
+  uint32_t *post = 0;      // result slot of the outstanding AP read
+  uint32_t posted = 0;     // and its entry
+  uint32_t ack, tmp;
+  uint32_t i, j;
+
+  for (i = 0; i < count; i++) {
+    swd_xfer_t *x = &list[i];
+    uint32_t req = x->req;
+
+    // back to back AP reads keep the pipeline going
+
+    if (post && ((req & SW_REQ_APRD) == SW_REQ_APRD) && !x->mask) {
+      if ((ack = xferOne(req, post)) != SW_ACK_OK)
+	return xferFail(ack, posted, fail);   // its result never came
+      post = &x->data;
+      posted = i;
+      continue;
+    }
+
+    // anything else drains it first
+
+    if (post) {
+      if ((ack = xferOne(SW_RDBUFF_RD, post)) != SW_ACK_OK)
+	return xferFail(ack, posted, fail);
+      post = 0;
+    }
+
+    if (!(req & SW_REQ_RnW) || !x->mask) {
+      if ((ack = xferOne(req, &x->data)) != SW_ACK_OK)
+	return xferFail(ack, i, fail);
+      if ((req & SW_REQ_APRD) == SW_REQ_APRD) {
+	post = &x->data;
+	posted = i;
+      }
+      continue;
+    }
+
+    // value match
+
+    for (j = 0; ; j++) {
+      ack = xferOne(req, &tmp);
+      if ((ack == SW_ACK_OK) && (req & SW_REQ_APnDP))
+	ack = xferOne(SW_RDBUFF_RD, &tmp);
+      if (ack != SW_ACK_OK)
+	return xferFail(ack, i, fail);
+      if ((tmp & x->mask) == (x->data & x->mask))
+	break;
+      if (j + 1 >= REGRETRIES)
+	return xferFail(SW_XFER_MISMATCH, i, fail);
+    }
+    x->data = tmp;
+  }
+  if (post && ((ack = xferOne(SW_RDBUFF_RD, post)) != SW_ACK_OK))
+    return xferFail(ack, posted, fail);
+  return 0;
+}
+
+/*
+ *   Raw DP/AP access
+ *
+ *     SWD_DAPBatch() runs host supplied register accesses by port and
+ *     address, the bank in address bits 7:4.  Any AP number can be
+ *     reached, not just the enumerated ones.  SELECT is written only
+ *     when the port or bank changes, and reads of one AP are pipelined
+ *     like SWD_Transfer's.  Afterwards SELECT is back at bank 0 of the
+ *     selected AP, so the cached state the other routines rely on
+ *     stays valid.  Ports above 0xFF (other than the DP), addresses
+ *     above 0xFF and TARGETSEL writes are refused before anything goes
+ *     out on the wire; they are host errors, the target's sticky
+ *     flags are left alone.
+ */
+
+static uint32_t swdRequest(uint32_t ap, uint32_t rnw, uint32_t addr) {
+  uint32_t req = (addr & 0xC) << 1;
+  if (ap)
+    req |= SW_REQ_APnDP;
+  if (rnw)
+    req |= SW_REQ_RnW;
+  if (Parity(req))
+    req |= SW_REQ_PARITY;
+  return req | SW_REQ_PARK_START;
+}
+
+uint32_t SWD_DAPBatch(swd_dap_t *list, uint32_t count, uint32_t *fail) {
+  uint32_t apsel = swd_apsel;
+  uint32_t select = apsel << 24;
+  uint32_t *post = 0;      // result slot of the outstanding AP read
+  uint32_t posted = 0;
+  uint32_t ack = SW_ACK_OK;
+  uint32_t i, want, req;
+
+  for (i = 0; i < count; i++) {
+    swd_dap_t *x = &list[i];
+    if ((x->port == SWD_DP_PORT) ?
+	(((x->addr & 0xC) == 0xC) && !x->rnw) :  // TARGETSEL, line reset only
+	(x->port > 0xFF)) {
+      if (fail)
+	*fail = i;
+      return SW_ACK_FAULT;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    swd_dap_t *x = &list[i];
+    bool ap = x->port != SWD_DP_PORT;
+
+    if (ap) {
+      want = ((uint32_t) x->port << 24) | (x->addr & SELECT_APBANK);
+    } else if ((x->addr & 0xC) == 0x4) {
+      want = (select & ~SELECT_DPBANK) | ((x->addr >> 4) & SELECT_DPBANK);
+    } else
+      want = select;
+    req = swdRequest(ap, x->rnw, x->addr);
+
+    // back to back reads of one AP keep the pipeline going
+
+    if (post && ap && x->rnw && (want == select)) {
+      if ((ack = xferOne(req, post)) != SW_ACK_OK) {
+	i = posted;          // its result never came
+	break;
+      }
+      post = &x->data;
+      posted = i;
+      continue;
+    }
+    if (post) {
+      if ((ack = xferOne(SW_RDBUFF_RD, post)) != SW_ACK_OK) {
+	i = posted;
+	break;
+      }
+      post = 0;
+    }
+    if (want != select) {
+      if ((ack = xferOne(SW_SELECT_WR, &want)) != SW_ACK_OK)
+	break;
+      select = want;
+    }
+    if (ap)
+      swd_apsel = x->port;   // keeps SWD_Access off SELECT
+    if ((ack = xferOne(req, &x->data)) != SW_ACK_OK)
+      break;
+    if (ap && x->rnw) {
+      post = &x->data;
+      posted = i;
+    }
+    if (req == SW_SELECT_WR)
+      select = x->data;
+  }
+  if ((ack == SW_ACK_OK) && post &&
+      ((ack = xferOne(SW_RDBUFF_RD, post)) != SW_ACK_OK))
+    i = posted;
+
+  swd_apsel = apsel;
+  if (ack != SW_ACK_OK) {
+    EPRINTF("dap batch fail %d entry %d\r\n", ack, i);
+    if (fail)
+      *fail = i;
+    errorClear(ack);
+    return ack;
+  }
+  want = apsel << 24;
+  if (select != want)
+    return errorClear(SWD_Access(SW_SELECT_WR, &want, MAX_SWD_RETRY));
+  return 0;
+}
+
+uint32_t SWD_ReadDAP(uint32_t port, uint32_t addr, uint32_t *data) {
+  swd_dap_t x = { port, addr, 1, 0 };
+  if (((port > 0xFF) && (port != SWD_DP_PORT)) || (addr > 0xFF) ||
+      SWD_DAPBatch(&x, 1, 0))
+    return 1;
+  *data = x.data;
+  return 0;
+}
+
+uint32_t SWD_WriteDAP(uint32_t port, uint32_t addr, uint32_t data) {
+  swd_dap_t x = { port, addr, 0, data };
+  if (((port > 0xFF) && (port != SWD_DP_PORT)) || (addr > 0xFF))
+    return 1;
+  return SWD_DAPBatch(&x, 1, 0) ? 1 : 0;
+}
+
+/*
+ *   Wire timing
+ *
+ *     The turnaround is programmed into the DP's DLCR (WCR), which is
+ *     reached through SELECT.CTRLSEL.  The target switches after the
+ *     DLCR write completes, so the host switches with it.  Idle cycles
+ *     are host side only.
+ */
+
+static uint32_t writeDLCR(uint32_t turn) {
+  uint32_t tmp;
+  tmp = (swd_apsel << 24) | CTRLSEL;
+  TRANSACTION(SW_SELECT_WR, &tmp);
+  tmp = DLCR_TURNROUND(turn) | DLCR_WIREMODE_SYNC;
+  TRANSACTION(SW_DLCR_WR, &tmp);
+  swd_turn = turn;
+  rtCheck();
+  tmp = swd_apsel << 24;
+  TRANSACTION(SW_SELECT_WR, &tmp);
+  return 0;
+}
+
+uint32_t SWD_SetWireTiming(uint32_t turn, uint32_t idle) {
+  if ((turn < 1) || (turn > 4))
+    return 1;
+  swd_turn_cfg = turn;
+  swd_idle     = idle;
+  rtCheck();
+  if (CoreID && (swd_turn != turn) && !swd_jtag)
+    return writeDLCR(turn);
+  return 0;
+}
+
+/*
+ *   Transport
+ *
+ *     SWD_Open connects over JTAG-DP instead of SWD while set.  Fails
+ *     unless built with SWD_USE_JTAG.
+ */
+
+uint32_t SWD_SetJTAG(uint32_t jtag) {
+#if SWD_USE_JTAG
+  if (swd_jtag && !jtag)
+    toInput(LINE_TGT_TDI);
+  if (swd_jtag != jtag)
+    swd_parked = 0;
+  swd_jtag = jtag;
+  rtCheck();
+  return 0;
+#else
+  return jtag ? 1 : 0;
+#endif
+}
+
+/*
+ *   WAIT limit and transfer statistics
+ */
+
+// retries are capped at about SWD_WAIT_MAX_MS of sleeping
+
+#define WAIT_LIMIT_MAX (SWD_WAIT_SPIN + SWD_WAIT_MAX_MS*1000/SWD_WAIT_MAX_US)
+
+uint32_t SWD_SetWaitLimit(uint32_t retries) {
+  if (retries > WAIT_LIMIT_MAX)
+    retries = WAIT_LIMIT_MAX;
+  if (retries)
+    swd_wait_limit = retries;
+  return swd_wait_limit;
+}
+
+void SWD_GetStats(swd_stats_t *stats) {
+  *stats = swd_stats;
+}
+
+void SWD_ClearStats(void) {
+  memset(&swd_stats, 0, sizeof(swd_stats));
+}
+
+static void swdRelease(void) {
+  uint32_t tmp;
+  // back to the default turnaround for whoever connects next
+  if ((swd_turn != 1) && !swd_jtag)
+    writeDLCR(1);
+  // release power up
+  tmp = 0;
+  SWD_Transaction(SW_CTRLSTAT_WR, &tmp, 0);
+  cacheFlush();
+  SWD_Disconnect();
+}
+
+int32_t SWD_Close() {
+  uint32_t id = CoreID;
+  CoreID = 0;
+  // release debug mode 
+  SWD_writeWord(DBG_HCSR, DBGKEY);
+#if SWD_KEEP_LINK
+  // leave the DP powered and the pins driven for the next SWD_Open,
+  // SWD_Release powers it down if that does not come soon
+  swd_parked = id;
+#else
+  (void) id;
+  swdRelease();
+#endif
+  return 0;
+}
+
+// power down a link SWD_Close left up
+
+void SWD_Release(void) {
+  if (!swd_parked)
+    return;
+  swd_parked = 0;
+  EPRINTF("swd released\r\n");
+  swdRelease();
+}
+
+/*
+ *   AP enumeration and selection
+ *
+ *     IDR sits at 0xFC (bank 0xF, same command as DRW_RD).  Slots are
+ *     read until the first empty one; AP 0 must answer.  AHB-APs use
+ *     CSW_VALUE, other MEM-APs keep the protection bits they reset
+ *     with.  The auto-increment page follows the AP type: ADIv5 only
+ *     promises 1 KB (TAR[9:0]), the CoreSight AXI-AP increments
+ *     across 4 KB.
+ */
+
+static uint32_t apPage(uint32_t idr) {
+  if ((AP_IDR_CLASS(idr) == AP_CLASS_MEM) && (AP_IDR_TYPE(idr) == AP_TYPE_AXI))
+    return 4096;
+  return AUTO_INCREMENT_PAGE_SIZE;
+}
+
+static uint32_t apScan(void) {
+  uint32_t ack, tmp, i;
+  for (i = 0; i < SWD_MAX_APS; i++) {
+    apSelect(i);
+    tmp = (i << 24) | SELECT_APBANK;
+    ack = SWD_Access(SW_SELECT_WR, &tmp, MAX_SWD_RETRY);
+    if (ack == SW_ACK_OK)
+      ack = SWD_Access(SW_IDR_RD, &tmp, MAX_SWD_RETRY);    // discard result
+    if (ack == SW_ACK_OK)
+      ack = SWD_Access(SW_RDBUFF_RD, &tmp, MAX_SWD_RETRY); // now read the result
+    if (ack != SW_ACK_OK) {
+      errorClear(ack);
+      break;
+    }
+    if ((tmp == 0) && i)
+      break;
+    EPRINTF("AP %d IDR 0x%x\r\n", i, tmp);
+    swd_aps[i].idr    = tmp;
+    swd_aps[i].csw    = CSW_VALUE & ~CSW_ADDRINC;
+    swd_aps[i].page   = apPage(tmp);
+    swd_aps[i].packed = -1;
+    swd_aps[i].valid  = 0;
+    if ((AP_IDR_CLASS(tmp) == AP_CLASS_MEM) &&
+	(AP_IDR_TYPE(tmp) != AP_TYPE_AHB3) &&
+	(AP_IDR_TYPE(tmp) != AP_TYPE_AHB5)) {
+      tmp = i << 24;
+      if ((SWD_Access(SW_SELECT_WR, &tmp, MAX_SWD_RETRY) == SW_ACK_OK) &&
+	  (SWD_Access(SW_CSW_RD, &tmp, MAX_SWD_RETRY) == SW_ACK_OK) &&
+	  (SWD_Access(SW_RDBUFF_RD, &tmp, MAX_SWD_RETRY) == SW_ACK_OK))
+	swd_aps[i].csw = tmp & ~(CSW_SIZE | CSW_ADDRINC | CSW_TINPROG);
+    }
+  }
+  swd_naps = i;
+  return (i == 0);
+}
+
+// memory accesses go to ap until the next call
+
+uint32_t SWD_SelectAP(uint32_t ap) {
+  if ((ap >= SWD_MAX_APS) || (swd_naps && ((ap >= swd_naps) ||
+       (AP_IDR_CLASS(swd_aps[ap].idr) != AP_CLASS_MEM)))) {
+    swd_ap_bad = true;
+    return 1;
+  }
+  apSelect(ap);
+  return 0;
+}
+
+uint32_t SWD_InitAP(uint32_t ap) {
+  if (ap >= swd_naps)
+    return 1;
+  return SWD_SelectAP(ap);
+}
+
+uint32_t SWD_CloseAP(uint32_t ap) {
+  if (ap >= swd_naps)
+    return 1;
+  swd_aps[ap].valid = 0;
+  swd_aps[ap].packed = -1;
+  if (ap == swd_apsel)
+    apSelect(0);
+  return 0;
+}
+
+uint32_t SWD_GetAPs(uint32_t *idr, uint32_t max) {
+  uint32_t i;
+  for (i = 0; (i < swd_naps) && (i < max); i++)
+    idr[i] = swd_aps[i].idr;
+  return i;
+}
+
+static int32_t _SWD_Open(void) {
+  uint32_t tmp;
+  int tries;
+  
+  //  SW_ShiftReset();  
+  if (SWD_Connect(&CoreID) != SW_ACK_OK) {
+    // a line reset leaves DLCR alone, but the target may have
+    // been power cycled back to the one clock default
+    if (swd_turn == 1)
+      return 1;
+    swd_turn = 1;
+    rtCheck();
+    if (SWD_Connect(&CoreID) != SW_ACK_OK)
+      return 1;
+  }
   // clear any pending errors
   //   EPRINTF("write clear ok\r\n");
   tmp = (STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR);
@@ -466,64 +2563,200 @@ int32_t SWD_Open() {
   // make sure everything is normal
   tmp = CSYSPWRUPREQ | CDBGPWRUPREQ | TRNNORMAL | MASKLANE;
   TRANSACTION(SW_CTRLSTAT_WR, &tmp);
-  // Read ID register -- set bank register to 0xF, read 0xFC (same command as DRW_RD)
-  tmp = 0xF0;
-  TRANSACTION(SW_SELECT_WR, &tmp);    
-  TRANSACTION(SW_IDR_RD, &tmp);   // discard result
-  TRANSACTION(SW_RDBUFF_RD,&tmp);  // now read the result
-  //  EPRINTF("ID register 0x%x\r\n",tmp);
-  //  EPRINTF("reset apsel\r\n");
-  // reset APSEL to 0
+  // find the APs, the core is on AP 0
+  if (apScan())
+    return 1;
+  apSelect(0);
   tmp = 0;
   TRANSACTION(SW_SELECT_WR, &tmp);    
   // set CSW to 32-bit, autoinc
-  tmp = CSW_VALUE | CSW_SIZE32;       
+  tmp = CSW_BASE | CSW_SADDRINC | CSW_SIZE32;
   TRANSACTION(SW_CSW_WR, &tmp);  
+  // turnaround
+  if ((swd_turn != swd_turn_cfg) && !swd_jtag)
+    if ((tries = writeDLCR(swd_turn_cfg)))
+      return tries;
   // enable debugging
 
   return SWD_writeWord(DBG_HCSR, (DBGKEY | C_DEBUGEN));
 }
 
+#if SWD_AUTO_CLOCK
+
+// IDCODE and a DCRDR write/read-back must come through clean
+
+static int clockTest(void) {
+  uint32_t tmp;
+  uint32_t pattern = 0x55AA55AA;
+  int i;
+  for (i = 0; i < SWD_CLOCK_PASSES; i++) {
+    if ((SWD_Transaction(SW_IDCODE_RD, &tmp, 0) != SW_ACK_OK) ||
+	(tmp != CoreID))
+      return 1;
+    if (SWD_writeWord(DBG_CRDR, pattern) ||
+	SWD_readWord(DBG_CRDR, &tmp) || (tmp != pattern))
+      return 1;
+    pattern = ~pattern;
+  }
+  return 0;
+}
+
+static int32_t swdOpen(void) {
+  int32_t err;
+  swd_tuning = true;
+  setClock(swd_ceiling);
+  while ((err = _SWD_Open()) || clockTest()) {
+    if (swd_clock + 1 >= SWD_CLOCKS) {
+      err = err ? err : 1;
+      break;
+    }
+    setClock(swd_clock + 1);
+  }
+  swd_tuning = false;
+  swd_good = swd_errors = 0;
+  EPRINTF("swd open %d at %d kHz\r\n", err, swd_khz);
+  return err;
+}
+
+#else
+
+static int32_t swdOpen(void) {
+  return _SWD_Open();
+}
+
+#endif
+
+// sticky flags cleared, DP still powered up.  An AP access that ran
+// out of WAITs is still pending, DAPABORT cancels it.
+
+static bool dpHealthy(void) {
+  uint32_t tmp;
+  tmp = (STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR);
+  if (swd_timedout)
+    tmp |= DAPABORT;
+  swd_timedout = false;
+  if (SWD_Transaction(SW_ABORT_WR, &tmp, 0) != SW_ACK_OK)
+    return false;
+  tmp = swd_apsel << 24;
+  if (SWD_Access(SW_SELECT_WR, &tmp, 0) != SW_ACK_OK)
+    return false;
+  if (SWD_Transaction(SW_CTRLSTAT_RD, &tmp, 0) != SW_ACK_OK)
+    return false;
+  return ((tmp & 0xF0000000) == 0xF0000000) &&
+    !(tmp & (STICKYERR | STICKYORUN));
+}
+
+/*
+ *  A link SWD_Close left up (SWD_KEEP_LINK) is taken over again when
+ *  it still reads the same IDCODE and CTRL/STAT shows the DP powered,
+ *  skipping the port switch, power up, AP scan and clock tuning.  The
+ *  command loop calls SWD_Release once the host has been quiet for
+ *  SWD_PARK_MS, so a parked target does not stay powered up.
+ */
+
+static int32_t swdResume(void) {
+  uint32_t id = swd_parked;
+  uint32_t tmp;
+  swd_parked = 0;
+  if (!id)
+    return 1;
+  if ((SWD_Transaction(SW_IDCODE_RD, &tmp, 0) != SW_ACK_OK) || (tmp != id))
+    return 1;
+  cacheFlush();
+  if (!dpHealthy())
+    return 1;
+  CoreID = id;
+  apSelect(0);
+  EPRINTF("swd resumed\r\n");
+  return SWD_writeWord(DBG_HCSR, (DBGKEY | C_DEBUGEN));
+}
+
+// the open leaves AP 0 selected, the host's choice is put back after
+
+int32_t SWD_Open() {
+  uint32_t ap = swd_apsel;
+  int32_t err;
+  if ((err = swdResume()))
+    err = swdOpen();
+  if (!err && (ap < swd_naps))
+    apSelect(ap);
+  return err;
+}
+
+/*
+ *   Recovery
+ *
+ *     SWD_Recover() brings the link back after a failed command with
+ *     the cheapest step that works: clear the sticky flags (and abort
+ *     the AP access after a WAIT timeout) and check that the DP is
+ *     still powered, else a line reset that must read back the same
+ *     IDCODE followed by the same check, else a full SWD_Open.
+ *     Returns the level used, also kept in the statistics.
+ */
+
+uint32_t SWD_Recover(void) {
+  uint32_t level;
+  uint32_t tmp;
+
+  cacheFlush();
+  if (CoreID && dpHealthy())
+    level = SWD_RECOVER_CLEAR;
+  else if (CoreID && (SWD_LineReset(&tmp) == SW_ACK_OK) &&
+	   (tmp == CoreID) && dpHealthy())
+    level = SWD_RECOVER_RESET;
+  else if (!SWD_Open())
+    level = SWD_RECOVER_OPEN;
+  else
+    level = SWD_RECOVER_FAIL;
+  EPRINTF("swd recover level %d\r\n", level);
+  if (level > swd_stats.recover)
+    swd_stats.recover = level;
+  return level;
+}
+
 uint32_t SWD_writeWord(uint32_t address, uint32_t data) {
-  return _SWD_writeMem32(address, &data, 4);
+  uint32_t done;
+  return _SWD_writeMem32(address, &data, 4, &done);
 }
 
 uint32_t SWD_readWord(uint32_t address, uint32_t *data) {
-  return _SWD_readMem32(address, data, 4);
+  uint32_t done;
+  return _SWD_readMem32(address, data, 4, &done);
 }
 
+// core registers go through DCRSR/DCRDR with the selected AP's
+// address increment off, so DHCSR can be polled in place.  CSW is left
+// that way, the block routines set their own (a no-op when cached).
+
+#define CSW_NOINC (CSW_BASE | CSW_SIZE32)
+
 uint32_t SWD_readReg(uint32_t idx, uint32_t *value) {
-  int i;
-  // request read
-  if (SWD_writeWord(DBG_CRSR, idx))
+  swd_xfer_t x[] = {
+    { SW_CSW_WR, CSW_NOINC,              0 },
+    { SW_TAR_WR, DBG_CRSR,               0 },
+    { SW_DRW_WR, idx,                    0 },
+    { SW_TAR_WR, DBG_HCSR,               0 },
+    { SW_DRW_RD, S_REGRDY,        S_REGRDY },
+    { SW_TAR_WR, DBG_CRDR,               0 },
+    { SW_DRW_RD, 0,                      0 },
+  };
+  if (SWD_Transfer(x, sizeof(x)/sizeof(x[0]), 0))
     return 1;
-  // wait for data
-
-  for (i = 0; i < REGRETRIES; i++) {
-    if (SWD_readWord(DBG_HCSR, value)) 
-      return 1;
-    if (*value & S_REGRDY)
-      return SWD_readWord(DBG_CRDR, value);
-  }
-  return 1;
+  *value = x[6].data;
+  return 0;
 }
 
 uint32_t SWD_writeReg(uint32_t idx, uint32_t value) {
-  int i;
-  // write register value
-  if (SWD_writeWord(DBG_CRDR, value))
-    return 1;
-  // request write
-  if (SWD_writeWord(DBG_CRSR, idx | REGWnR))
+  swd_xfer_t x[] = {
+    { SW_CSW_WR, CSW_NOINC,              0 },
+    { SW_TAR_WR, DBG_CRDR,               0 },
+    { SW_DRW_WR, value,                  0 },
+    { SW_TAR_WR, DBG_CRSR,               0 },
+    { SW_DRW_WR, idx | REGWnR,           0 },
+    { SW_TAR_WR, DBG_HCSR,               0 },
+    { SW_DRW_RD, S_REGRDY,        S_REGRDY },
+  };
+  if (SWD_Transfer(x, sizeof(x)/sizeof(x[0]), 0))
     return 1;
-  // wait for acknowledgement
-  for (i = 0; i < REGRETRIES; i++) {
-    if (SWD_readWord(DBG_HCSR, &value))
-      return 1;
-    if (value & S_REGRDY) {
-      return 0;
-    }
-  }
-  return 1;
+  return 0;
 }
-
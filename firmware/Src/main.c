@@ -20,6 +20,8 @@
 #include "stm32f0xx_ll_crs.h"
 #include "usbcfg.h"
 #include "app.h"
+#include "swdconf.h"
+#include "dp_swd.h"
 
 #define  RCC_APB1ENR_CRSN     ((uint32_t)0x08000000U)
 
@@ -144,7 +146,19 @@ int main(void) {
   
   while (true) {
     int n = 0;
+#if SWD_KEEP_LINK
+    // power a parked link down once the host goes quiet
+    BULK_StartReceive(bulkbuf, 64);
+    n = BULK_WaitReceiveTimeout(TIME_MS2I(SWD_PARK_MS));
+    if (n == MSG_TIMEOUT) {
+      palSetLine(LINE_TGT_SWDIO_EN);
+      SWD_Release();
+      palClearLine(LINE_TGT_SWDIO_EN);
+      n = BULK_WaitReceive();
+    }
+#else
     n = BULK_Receive(bulkbuf, 64);
+#endif
     if (n != 16) {
       EPRINTF("received %d bytes expected 16\r\n", n);
       chThdSleepMilliseconds(10);
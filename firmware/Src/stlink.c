@@ -16,6 +16,7 @@
 * limitations under the License.                                          *
 **************************************************************************/
 
+#include <string.h>
 #include "hal.h"
 #include "stlink.h"
 #include "dp_swd.h"
@@ -29,8 +30,40 @@ static enum stlink_mode mode = STLINK_MODE_UNKNOWN;
 static uint8_t txbuf[128] __attribute__ ((aligned (4)));
 static uint8_t databuf[DATABUFSIZE] __attribute__ ((aligned (4)));
 
+// STLINK_DEBUG_IULINK_DAP_BATCH limits, the reply has to fit txbuf
+
+#define DAP_BATCH_INLINE 2
+#define DAP_BATCH_MAX    24
+
 static uint16_t lastrwstatus = STLINK_DEBUG_ERR_OK;
 
+// openocd's SWD divisor table for APIV2 SWD_SET_FREQ
+
+static const struct {
+  uint16_t khz;
+  uint16_t div;
+} swd_speed_map[] = {
+  { 4000,   0 },
+  { 1800,   1 },
+  { 1200,   2 },
+  {  950,   3 },
+  {  480,   7 },
+  {  240,  15 },
+  {  125,  31 },
+  {  100,  40 },
+  {   50,  79 },
+  {   25, 158 },
+  {   15, 265 },
+  {    5, 798 },
+};
+
+static uint32_t div2khz(uint16_t div) {
+  for (unsigned i = 0; i < sizeof(swd_speed_map)/sizeof(swd_speed_map[0]); i++)
+    if (swd_speed_map[i].div >= div)
+      return swd_speed_map[i].khz;
+  return 5;
+}
+
 static inline uint8_t *PACK16(uint8_t *buf, uint16_t val) {
   buf[0] = val;
   buf[1] = val>>8;
@@ -86,14 +119,35 @@ int stlink_eval(uint8_t *buf) {
   // evaluate debug command
 
   int swderr;
+  int hosterr = 0;         // bad arguments, not a link failure
   uint32_t tmpreg;
   msg_t rlen;
-  switch (*buf++) {
+  swd_stats_t stats;
 
-  case STLINK_DEBUG_ENTER_JTAG:   
-    PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
-    BULK_Transmit(txbuf,2);    // return 2 bytes
+  // statistics cover one command, the query returns the previous one's
+  if (*buf != STLINK_DEBUG_IULINK_SWD_WAIT)
+    SWD_ClearStats();
+
+  // memory commands name their AP after the length, the rest use AP 0
+
+  switch (*buf) {
+  case STLINK_DEBUG_APIV2_READMEM_16BIT:
+  case STLINK_DEBUG_APIV2_WRITEMEM_16BIT:
+    hosterr = (UNPACK32(&buf[1]) | UNPACK16(&buf[5])) & 1;
+    // fall through
+  case STLINK_DEBUG_READMEM_32BIT:
+  case STLINK_DEBUG_WRITEMEM_32BIT:
+  case STLINK_DEBUG_READMEM_8BIT:
+  case STLINK_DEBUG_WRITEMEM_8BIT:
+    if (SWD_SelectAP(buf[7]))   // a bad AP fails the transfer
+      hosterr = 1;
     break;
+  default:
+    SWD_SelectAP(0);
+  }
+
+  switch (*buf++) {
+
   case STLINK_DEBUG_GETSTATUS:
     PACK16(txbuf,STLINK_DEBUG_ERR_OK);
     BULK_Transmit(txbuf,2);    // return 2 bytes
@@ -108,12 +162,13 @@ int stlink_eval(uint8_t *buf) {
     while (len) {
       int tmplen = len > DATABUFSIZE ? DATABUFSIZE : len;
       len -= tmplen;
-      swderr = SWD_readMem32(addr, (uint32_t *) databuf, tmplen);
+      swderr = hosterr ? 1 : SWD_readMem(addr, databuf, tmplen);
       addr += tmplen;
       if (swderr) {
 	lastrwstatus = STLINK_DEBUG_ERR_FAULT;
 	EPRINTF("error on mem32 read: 0x%x\r\n", addr);
-	SWD_Open();  // reset interface
+	if (!hosterr)
+	  SWD_Recover();  // bring the link back
 	break;
       } else {
 	lastrwstatus = STLINK_DEBUG_ERR_OK;
@@ -125,9 +180,49 @@ int stlink_eval(uint8_t *buf) {
     }
     break;
   case STLINK_DEBUG_WRITEMEM_32BIT:
+    // ping-pong between the halves of databuf so that the next
+    // chunk is received while the current one goes out over SWD
     addr = UNPACK32(buf);
     len =  UNPACK16(&buf[4]);
-    swderr = 0;
+    swderr = hosterr;       // still take the data, write none of it
+    lastrwstatus = STLINK_DEBUG_ERR_OK;
+    {
+      uint8_t *cur = databuf;
+      uint8_t *next = databuf + DATABUFSIZE/2;
+      int tmplen = len > DATABUFSIZE/2 ? DATABUFSIZE/2 : len;
+      if (len)
+	BULK_StartReceive(cur, tmplen);
+      while (0 < len) {
+	uint8_t *tmpbuf;
+	int nextlen;
+	rlen = BULK_WaitReceive();
+	if (tmplen != rlen) {
+	  EPRINTF("Received %d bytes, expected %d bytes\n", tmplen, rlen);
+	  lastrwstatus = STLINK_DEBUG_ERR_FAULT;
+	  break;
+	}
+	len -= tmplen;
+	nextlen = len > DATABUFSIZE/2 ? DATABUFSIZE/2 : len;
+	if (nextlen)
+	  BULK_StartReceive(next, nextlen);
+	if (!swderr)
+	  swderr |= SWD_writeMem(addr, cur, tmplen);
+	addr += tmplen;
+	tmpbuf = cur; cur = next; next = tmpbuf;
+	tmplen = nextlen;
+      }
+    }
+    if (swderr) {
+      lastrwstatus = STLINK_DEBUG_ERR_FAULT;
+      EPRINTF("error on write mem32 \n");
+      if (!hosterr)
+	SWD_Recover();  // bring the link back
+    }
+    break;
+  case STLINK_DEBUG_WRITEMEM_8BIT:
+    addr = UNPACK32(buf);
+    len =  UNPACK16(&buf[4]);
+    swderr = hosterr;       // still take the data, write none of it
     lastrwstatus = STLINK_DEBUG_ERR_OK;
     while (0 < len) {
       int tmplen = len > DATABUFSIZE ? DATABUFSIZE : len;
@@ -139,19 +234,45 @@ int stlink_eval(uint8_t *buf) {
 	break;
       }
       if (!swderr)
-	swderr |= SWD_writeMem32(addr, (uint32_t *) databuf, tmplen);
+	swderr = SWD_writeMem8(addr, databuf, tmplen);
       addr += tmplen;
     }
     if (swderr) {
       lastrwstatus = STLINK_DEBUG_ERR_FAULT;
-      EPRINTF("error on write mem32 \n");
-      SWD_Open();  // reset interface
+      EPRINTF("error on write mem8 \n");
+      if (!hosterr)
+	SWD_Recover();  // bring the link back
     }
     break;
-  case STLINK_DEBUG_WRITEMEM_8BIT:
+  case STLINK_DEBUG_READMEM_8BIT:
+    addr = UNPACK32(buf);
+    len =  UNPACK16(&buf[4]);
+
+    while (0 < len) {
+      int tmplen = len > DATABUFSIZE ? DATABUFSIZE : len;
+      len -= tmplen;
+      swderr = hosterr ? 1 : SWD_readMem8(addr, databuf, tmplen);
+      addr += tmplen;
+      if (swderr) {
+	lastrwstatus = STLINK_DEBUG_ERR_FAULT;
+	EPRINTF("error on mem8 read: 0x%x\r\n", addr);
+	if (!hosterr)
+	  SWD_Recover();  // bring the link back
+	break;
+      } else {
+	lastrwstatus = STLINK_DEBUG_ERR_OK;
+	if (BULK_Transmit(databuf,tmplen) == 0) {
+	  lastrwstatus = STLINK_DEBUG_ERR_FAULT;
+	  EPRINTF("error on mem8 read: 0x%x\r\n", addr);
+	  break;
+	}
+      }
+    }
+    break;
+  case STLINK_DEBUG_APIV2_WRITEMEM_16BIT:
     addr = UNPACK32(buf);
     len =  UNPACK16(&buf[4]);
-    swderr = 0;
+    swderr = hosterr;       // still take the data, write none of it
     lastrwstatus = STLINK_DEBUG_ERR_OK;
     while (0 < len) {
       int tmplen = len > DATABUFSIZE ? DATABUFSIZE : len;
@@ -163,34 +284,36 @@ int stlink_eval(uint8_t *buf) {
 	break;
       }
       if (!swderr)
-	swderr = SWD_writeMem8(addr, databuf, tmplen);
+	swderr = SWD_writeMem16(addr, databuf, tmplen);
       addr += tmplen;
     }
     if (swderr) {
       lastrwstatus = STLINK_DEBUG_ERR_FAULT;
-      EPRINTF("error on write mem8 \n");
-      SWD_Open();  // reset interface
+      EPRINTF("error on write mem16 \n");
+      if (!hosterr)
+	SWD_Recover();  // bring the link back
     }
     break;
-  case STLINK_DEBUG_READMEM_8BIT:
+  case STLINK_DEBUG_APIV2_READMEM_16BIT:
     addr = UNPACK32(buf);
     len =  UNPACK16(&buf[4]);
 
     while (0 < len) {
       int tmplen = len > DATABUFSIZE ? DATABUFSIZE : len;
       len -= tmplen;
-      swderr = SWD_readMem8(addr, databuf, tmplen);
+      swderr = hosterr ? 1 : SWD_readMem16(addr, databuf, tmplen);
       addr += tmplen;
       if (swderr) {
 	lastrwstatus = STLINK_DEBUG_ERR_FAULT;
-	EPRINTF("error on mem8 read: 0x%x\r\n", addr);
-	SWD_Open();  // reset interface
+	EPRINTF("error on mem16 read: 0x%x\r\n", addr);
+	if (!hosterr)
+	  SWD_Recover();  // bring the link back
 	break;
       } else {
 	lastrwstatus = STLINK_DEBUG_ERR_OK;
 	if (BULK_Transmit(databuf,tmplen) == 0) {
 	  lastrwstatus = STLINK_DEBUG_ERR_FAULT;
-	  EPRINTF("error on mem8 read: 0x%x\r\n", addr);
+	  EPRINTF("error on mem16 read: 0x%x\r\n", addr);
 	  break;
 	}
       }
@@ -206,13 +329,17 @@ int stlink_eval(uint8_t *buf) {
     PACK32(txbuf,CoreID);
     BULK_Transmit(txbuf,4);     // return 4 bytes
     break;
-  case STLINK_DEBUG_APIV2_ENTER:   // here's where we enter swd
-    if ((swderr = SWD_Open())) {
+  case STLINK_DEBUG_ENTER_JTAG:    // as APIV2_ENTER with a jtag argument
+  case STLINK_DEBUG_APIV2_ENTER:   // here's where we enter swd or jtag
+    value = (buf[-1] == STLINK_DEBUG_ENTER_JTAG) ||
+            (buf[0] == STLINK_DEBUG_ENTER_JTAG) ||
+            (buf[0] == STLINK_DEBUG_ENTER_JTAG_NO_RESET);
+    if ((swderr = SWD_SetJTAG(value)) || (swderr = SWD_Open())) {
       mode = STLINK_MODE_UNKNOWN;
       PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
       EPRINTF("swd error %d\r\n", swderr);
     } else {
-      mode = STLINK_MODE_DEBUG_SWD;
+      mode = value ? STLINK_MODE_DEBUG_JTAG : STLINK_MODE_DEBUG_SWD;
       PACK16(txbuf,STLINK_DEBUG_ERR_OK);
     }
     BULK_Transmit(txbuf,2);    // return 2 bytes
@@ -298,6 +425,139 @@ int stlink_eval(uint8_t *buf) {
     BULK_Transmit(txbuf,2);        // return 2 bytes
     break;
   case STLINK_DEBUG_APIV2_SWD_SET_FREQ:
+    value = SWD_SetFreq(div2khz(UNPACK16(buf)));
+    EPRINTF("swd clock %d kHz\r\n", value);
+    PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    BULK_Transmit(txbuf,2);        // return 2 bytes
+    break;
+  case STLINK_APIV3_SET_COM_FREQ:  // SWD only, kHz in, achieved kHz out
+    memset(txbuf, 0, 8);
+    if (buf[0]) {
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    } else {
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+      PACK32(txbuf+4,SWD_SetFreq(UNPACK32(&buf[2])));
+    }
+    BULK_Transmit(txbuf,8);        // return 8 bytes
+    break;
+  case STLINK_APIV3_GET_COM_FREQ:  // supported rates, fastest first
+    memset(txbuf, 0, 52);
+    PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    txbuf[8] = SWD_GetFreqTable((uint32_t *) (txbuf+12), 10);
+    BULK_Transmit(txbuf,52);       // return 52 bytes
+    break;
+  case STLINK_DEBUG_IULINK_SWD_SAMPLE:  // read sample delay in cycles
+    memset(txbuf, 0, 8);
+    PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    PACK32(txbuf+4,SWD_SetSampleDelay(UNPACK32(buf)));
+    BULK_Transmit(txbuf,8);        // return 8 bytes
+    break;
+  case STLINK_DEBUG_IULINK_SWD_TIMING:  // turnaround clocks, idle clocks
+    if (SWD_SetWireTiming(buf[0], buf[1]))
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    else
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    BULK_Transmit(txbuf,2);        // return 2 bytes
+    break;
+  case STLINK_DEBUG_APIV2_INIT_AP:
+    if (SWD_InitAP(buf[0]))
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    else
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    BULK_Transmit(txbuf,2);        // return 2 bytes
+    break;
+  case STLINK_DEBUG_APIV2_CLOSE_AP_DBG:
+    if (SWD_CloseAP(buf[0]))
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    else
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    BULK_Transmit(txbuf,2);        // return 2 bytes
+    break;
+  case STLINK_DEBUG_IULINK_AP_LIST:  // APs found on connect and their IDRs
+    memset(txbuf, 0, 8);
+    PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    txbuf[4] = SWD_GetAPs((uint32_t *) (txbuf+8), 16);
+    BULK_Transmit(txbuf,8 + 4*txbuf[4]);
+    break;
+  case STLINK_DEBUG_APIV2_READ_DAP_REG:   // port (0xffff = DP), address
+    memset(txbuf, 0, 8);
+    if ((swderr = SWD_ReadDAP(UNPACK16(buf), UNPACK16(&buf[2]), &value)))
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    else
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    PACK32(txbuf+4,value);
+    BULK_Transmit(txbuf,8);        // return 8 bytes
+    break;
+  case STLINK_DEBUG_APIV2_WRITE_DAP_REG:  // port, address, value
+    value = UNPACK32(&buf[4]);
+    if ((swderr = SWD_WriteDAP(UNPACK16(buf), UNPACK16(&buf[2]), value)))
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    else
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    BULK_Transmit(txbuf,2);        // return 2 bytes
+    break;
+  case STLINK_DEBUG_IULINK_DAP_BATCH:
+    // count, then 6 bytes per access: port (0xff = DP), address
+    // with RnW in bit 0, value.  Up to DAP_BATCH_INLINE accesses fit
+    // in the command, more come in a data phase.  Returns status,
+    // accesses done and a value per access.
+    len = buf[0];
+    if (len > DAP_BATCH_MAX) {
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+      BULK_Transmit(txbuf,2);
+      break;
+    }
+    if (len <= DAP_BATCH_INLINE)
+      memcpy(databuf, &buf[1], len*6);
+    else if ((rlen = BULK_Receive(databuf, len*6)) != len*6) {
+      EPRINTF("Received %d bytes, expected %d bytes\n", rlen, len*6);
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+      BULK_Transmit(txbuf,2);
+      break;
+    }
+    {
+      swd_dap_t *dap = (swd_dap_t *) (databuf + DAP_BATCH_MAX*6 + 4);
+      uint32_t done = len;
+      for (idx = 0; idx < len; idx++) {
+	uint8_t *p = databuf + idx*6;
+	dap[idx].port = (p[0] == 0xff) ? SWD_DP_PORT : p[0];
+	dap[idx].addr = p[1] & ~1;
+	dap[idx].rnw  = p[1] & 1;
+	dap[idx].data = UNPACK32(&p[2]);
+      }
+      memset(txbuf, 0, 4 + 4*len);
+      if (SWD_DAPBatch(dap, len, &done))
+	PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+      else
+	PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+      txbuf[2] = done;
+      for (idx = 0; idx < done; idx++)
+	PACK32(txbuf+4+4*idx, dap[idx].data);
+    }
+    BULK_Transmit(txbuf,4 + 4*len);
+    break;
+  case STLINK_DEBUG_IULINK_SWD_TARGET:  // multidrop TARGETSEL, 0 = none
+    memset(txbuf, 0, 8);
+    if (SWD_SelectTarget(UNPACK32(buf), &value))
+      PACK16(txbuf,STLINK_DEBUG_ERR_FAULT);
+    else
+      PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    PACK32(txbuf+4,value);
+    BULK_Transmit(txbuf,8);        // return 8 bytes
+    break;
+  case STLINK_DEBUG_IULINK_SWD_WAIT:  // WAIT limit (0 = keep), stats
+    SWD_GetStats(&stats);
+    PACK16(txbuf,STLINK_DEBUG_ERR_OK);
+    PACK16(txbuf+2,0);
+    PACK32(txbuf+4,SWD_SetWaitLimit(UNPACK32(buf)));
+    PACK32(txbuf+8,stats.waits);
+    PACK32(txbuf+12,stats.sleeps);
+    PACK32(txbuf+16,stats.retries);
+    PACK32(txbuf+20,stats.recover);
+    BULK_Transmit(txbuf,24);       // return 24 bytes
+    break;
+  case STLINK_DEBUG_IULINK_STRICT_BYTES:  // byte reads as byte accesses
+    SWD_SetStrictBytes(buf[0]);
     PACK16(txbuf,STLINK_DEBUG_ERR_OK);
     BULK_Transmit(txbuf,2);        // return 2 bytes
     break;
@@ -258,6 +258,39 @@ msg_t BULK_Receive(uint8_t *Buf, uint16_t len) {
   return usbReceive(&USBD1,BULK_OUT_EP,Buf,len);
 }
 
+/*
+ *  Split receive so that the caller can work while the next bulk
+ *  transfer arrives.  BULK_WaitReceive returns the byte count, as
+ *  BULK_Receive does, or MSG_RESET.  BULK_WaitReceiveTimeout can also
+ *  return MSG_TIMEOUT, the receive stays pending and can be waited
+ *  for again.
+ */
+
+void BULK_StartReceive(uint8_t *Buf, uint16_t len) {
+  osalSysLock();
+  if (usbGetDriverStateI(&USBD1) == USB_ACTIVE)
+    usbStartReceiveI(&USBD1,BULK_OUT_EP,Buf,len);
+  osalSysUnlock();
+}
+
+msg_t BULK_WaitReceiveTimeout(sysinterval_t timeout) {
+  msg_t msg;
+  osalSysLock();
+  if (usbGetDriverStateI(&USBD1) != USB_ACTIVE)
+    msg = MSG_RESET;
+  else if (usbGetReceiveStatusI(&USBD1,BULK_OUT_EP))
+    msg = osalThreadSuspendTimeoutS(&USBD1.epc[BULK_OUT_EP]->out_state->thread,
+				    timeout);
+  else  // already complete
+    msg = usbGetReceiveTransactionSizeX(&USBD1,BULK_OUT_EP);
+  osalSysUnlock();
+  return msg;
+}
+
+msg_t BULK_WaitReceive(void) {
+  return BULK_WaitReceiveTimeout(TIME_INFINITE);
+}
+
 msg_t BULK_Transmit(uint8_t *Buf, uint16_t len){
   if (usbTransmit(&USBD1,BULK_IN_EP,Buf,len))
     return 0;